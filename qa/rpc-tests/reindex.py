@@ -4,7 +4,9 @@
 # file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #
-# Test -reindex and -reindex-chainstate with CheckBlockIndex
+# Test -reindex (with and without scan threads) and -reindex-chainstate with CheckBlockIndex
+# Also test -reindex of blocks spread over several block files, with a block
+# stored in an earlier file than its parent.
 #
 from test_framework.test_framework import BitcoinTestFramework
 from test_framework.util import (
@@ -12,8 +14,12 @@ from test_framework.util import (
     stop_nodes,
     assert_equal,
 )
+import os
+import struct
 import time
 
+REGTEST_MAGIC = b"\xfa\xbf\xb5\xda"
+
 class ReindexTest(BitcoinTestFramework):
 
     def __init__(self):
@@ -24,11 +30,50 @@ class ReindexTest(BitcoinTestFramework):
     def setup_network(self):
         self.nodes = start_nodes(self.num_nodes, self.options.tmpdir)
 
-    def reindex(self, justchainstate=False):
+    def reindex(self, justchainstate=False, reindexthreads=None):
         self.nodes[0].generate(3)
         blockcount = self.nodes[0].getblockcount()
         stop_nodes(self.nodes)
         extra_args = [["-debug", "-reindex-chainstate" if justchainstate else "-reindex", "-checkblockindex=1"]]
+        if reindexthreads is not None:
+            extra_args[0].append("-reindexthreads=%d" % reindexthreads)
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, extra_args)
+        while self.nodes[0].getblockcount() < blockcount:
+            time.sleep(0.1)
+        assert_equal(self.nodes[0].getblockcount(), blockcount)
+        print("Success")
+
+    def split_block_files(self):
+        # Move the second half of the blocks into blk00001.dat, and the first
+        # block of that half into blk00000.dat after its own child.
+        blocksdir = os.path.join(self.options.tmpdir, "node0", "regtest", "blocks")
+        blocks = []
+        for name in sorted(os.listdir(blocksdir)):
+            if not (name.startswith("blk") and name.endswith(".dat")):
+                continue
+            with open(os.path.join(blocksdir, name), "rb") as f:
+                data = f.read()
+            # Blocks need not be back to back (a reindex leaves gaps), so
+            # search for each header like the node does.
+            pos = data.find(REGTEST_MAGIC)
+            while pos >= 0:
+                size = struct.unpack("<I", data[pos + 4:pos + 8])[0]
+                blocks.append(data[pos:pos + 8 + size])
+                pos = data.find(REGTEST_MAGIC, pos + 8 + size)
+        half = len(blocks) // 2
+        with open(os.path.join(blocksdir, "blk00000.dat"), "wb") as f:
+            f.write(b"".join(blocks[:half] + [blocks[half + 1]]))
+        with open(os.path.join(blocksdir, "blk00001.dat"), "wb") as f:
+            f.write(b"".join([blocks[half]] + blocks[half + 2:]))
+
+    def reindex_split(self, reindexthreads):
+        # Reuse the blocks mined so far, as block times on this chain move
+        # ahead of the clock and mining many more would run into the
+        # future time limit.
+        blockcount = self.nodes[0].getblockcount()
+        stop_nodes(self.nodes)
+        self.split_block_files()
+        extra_args = [["-debug", "-reindex", "-checkblockindex=1", "-reindexthreads=%d" % reindexthreads]]
         self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, extra_args)
         while self.nodes[0].getblockcount() < blockcount:
             time.sleep(0.1)
@@ -38,8 +83,10 @@ class ReindexTest(BitcoinTestFramework):
     def run_test(self):
         self.reindex(False)
         self.reindex(True)
-        self.reindex(False)
+        self.reindex(False, reindexthreads=0)
         self.reindex(True)
+        self.reindex_split(reindexthreads=4)
+        self.reindex_split(reindexthreads=0)
 
 if __name__ == '__main__':
     ReindexTest().main()
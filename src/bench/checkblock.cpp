@@ -0,0 +1,57 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "primitives/block.h"
+#include "random.h"
+#include "script/script.h"
+#include "streams.h"
+#include "version.h"
+
+#include <vector>
+
+/** A block of transactions shaped like those on the network: two P2PKH or P2WPKH inputs and two outputs each. */
+static CBlock BuildBenchBlock()
+{
+    CBlock block;
+    for (int i = 0; i < 2000; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        tx.vout.resize(2);
+        bool fWitness = i % 3 == 0;
+        if (fWitness)
+            tx.wit.vtxinwit.resize(2);
+        for (int j = 0; j < 2; j++) {
+            tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+            std::vector<unsigned char> vchSig(72, i), vchPubKey(33, j);
+            if (fWitness) {
+                tx.wit.vtxinwit[j].scriptWitness.stack.push_back(vchSig);
+                tx.wit.vtxinwit[j].scriptWitness.stack.push_back(vchPubKey);
+            } else {
+                tx.vin[j].scriptSig = CScript() << vchSig << vchPubKey;
+            }
+            tx.vout[j].nValue = 1000 * i + j;
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+// Deserialize a block from memory, as ReadBlockFromDisk does.
+static void DeserializeBlock(benchmark::State& state)
+{
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << BuildBenchBlock();
+    std::vector<char> vData(ssBlock.begin(), ssBlock.end());
+    while (state.KeepRunning()) {
+        CMemoryReader reader(SER_NETWORK, PROTOCOL_VERSION, &vData[0], &vData[0] + vData.size());
+        CBlock block;
+        reader >> block;
+        assert(block.vtx.size() == 2000);
+    }
+}
+
+BENCHMARK(DeserializeBlock);
@@ -0,0 +1,28 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "key.h"
+#include "pubkey.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+// Verify a signature as CheckSig does for every input while connecting a block.
+static void ECDSAVerify(benchmark::State& state)
+{
+    ECCVerifyHandle verifyHandle;
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+    while (state.KeepRunning()) {
+        assert(pubkey.Verify(hash, vchSig));
+    }
+}
+
+BENCHMARK(ECDSAVerify);
@@ -11,10 +11,13 @@
 #include "streams.h"
 #include "txmempool.h"
 #include "main.h"
+#include "parallelranges.h"
 #include "util.h"
 
 #include <unordered_map>
 
+#include <boost/bind.hpp>
+
 #define MIN_TRANSACTION_BASE_SIZE (::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS))
 
 CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
@@ -46,6 +49,22 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const {
 }
 
 
+/** Marks mempool transactions whose short ID isn't in the block */
+static const uint16_t SHORTID_NO_MATCH = std::numeric_limits<uint16_t>::max();
+
+/**
+ * Set vMatch[i] to the position in the block of mempool transaction i, for i
+ * in [nBegin, nEnd), or to SHORTID_NO_MATCH. Only reads the mempool, so ranges
+ * can be matched on several threads at once.
+ */
+static void MatchShortIDs(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::unordered_map<uint64_t, uint16_t>& shorttxids,
+                          const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes, std::vector<uint16_t>& vMatch,
+                          size_t nBegin, size_t nEnd) {
+    for (size_t i = nBegin; i < nEnd; i++) {
+        std::unordered_map<uint64_t, uint16_t>::const_iterator idit = shorttxids.find(cmpctblock.GetShortID(vTxHashes[i].first));
+        vMatch[i] = idit == shorttxids.end() ? SHORTID_NO_MATCH : idit->second;
+    }
+}
 
 ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock) {
     if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
@@ -106,20 +125,23 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     std::vector<bool> have_txn(txn_available.size());
     LOCK(pool->cs);
     const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
+    // Hashing the short ID of every mempool transaction is most of the work, so
+    // a large mempool is matched on all cores. The key of the short IDs is new
+    // for every cmpctblock, so they can't be computed ahead of time.
+    std::vector<uint16_t> vMatch(vTxHashes.size());
+    ParallelForRanges(vTxHashes.size(), boost::bind(&MatchShortIDs, boost::cref(cmpctblock), boost::cref(shorttxids), boost::cref(vTxHashes), boost::ref(vMatch), _1, _2));
     for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
-                have_txn[idit->second]  = true;
+        if (vMatch[i] != SHORTID_NO_MATCH) {
+            if (!have_txn[vMatch[i]]) {
+                txn_available[vMatch[i]] = vTxHashes[i].second->GetSharedTx();
+                have_txn[vMatch[i]]  = true;
                 mempool_count++;
             } else {
                 // If we find two mempool txn that match the short id, just request it.
                 // This should be rare enough that the extra bandwidth doesn't matter,
                 // but eating a round-trip due to FillBlock failure would be annoying
-                if (txn_available[idit->second]) {
-                    txn_available[idit->second].reset();
+                if (txn_available[vMatch[i]]) {
+                    txn_available[vMatch[i]].reset();
                     mempool_count--;
                 }
             }
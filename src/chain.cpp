@@ -7,6 +7,24 @@
 
 using namespace std;
 
+/**
+ * CBlockIndexArena implementation
+ */
+CBlockIndex* CBlockIndexArena::Allocate() {
+    if (nUsed == CHUNK_SIZE) {
+        vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+        nUsed = 0;
+    }
+    return &vChunks.back()[nUsed++];
+}
+
+void CBlockIndexArena::Clear() {
+    for (size_t i = 0; i < vChunks.size(); i++)
+        delete[] vChunks[i];
+    vChunks.clear();
+    nUsed = CHUNK_SIZE;
+}
+
 /**
  * CChain implementation
  */
@@ -200,7 +200,11 @@ public:
     unsigned int nNonce;
 
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
-    uint32_t nSequenceId;
+    //! Shares its word with fChecked to keep the entry 8 bytes smaller.
+    uint32_t nSequenceId : 31;
+
+    //! (memory only) Whether the context-free checks (CheckBlock) passed for the block data we stored this session
+    uint32_t fChecked : 1;
 
     void SetNull()
     {
@@ -216,6 +220,7 @@ public:
         nChainTx = 0;
         nStatus = 0;
         nSequenceId = 0;
+        fChecked = false;
 
         nVersion       = 0;
         hashMerkleRoot = uint256();
@@ -404,6 +409,38 @@ public:
     }
 };
 
+/**
+ * Allocates CBlockIndex entries in large contiguous chunks rather than with
+ * one heap allocation each. This saves the allocator's per-object overhead
+ * and keeps entries loaded together next to each other in memory. Entries
+ * are never freed individually, only all at once by Clear().
+ */
+class CBlockIndexArena
+{
+private:
+    static const size_t CHUNK_SIZE = 4096;
+
+    std::vector<CBlockIndex*> vChunks;
+    //! Number of entries handed out from the last chunk
+    size_t nUsed;
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    /** Return a new, default constructed entry. */
+    CBlockIndex* Allocate();
+
+    /** Free all entries handed out so far. */
+    void Clear();
+
+    /** Number of entries handed out. */
+    size_t size() const { return vChunks.empty() ? 0 : (vChunks.size() - 1) * CHUNK_SIZE + nUsed; }
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain {
 private:
@@ -109,6 +109,12 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0x0000000000000000000000000000000000000000000004fd9e9fc4ede0e39de5");
 
+        // By default assume that the signatures in ancestors of this block are valid.
+        // This is the last checkpoint on purpose: it is the most recent block
+        // whose hash has been reviewed in this tree. Move it forward together
+        // with the checkpoints at release time.
+        consensus.defaultAssumeValid = uint256S("0x0000000000000000dae8a696d5d47ee9d7a080503e9596fbcde87d402bf4bcb9"); //122296
+
         //new pow limit target hex value
         consensus.pownewlimit = uint256S("0000000000000023CA7500000000000000000000000000000000000000000000");
         consensus.powmaxlimit = uint256S("0000000000000001d88000000000000000000000000000000000000000000000");
@@ -239,6 +245,9 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0x00");
 
+        // By default assume that the signatures in ancestors of this block are valid.
+        consensus.defaultAssumeValid = uint256S("0x00");
+
         // Testnet pow limits (use same as main for consistency)
         consensus.pownewlimit = uint256S("0000000000000023CA7500000000000000000000000000000000000000000000");
         consensus.powmaxlimit = uint256S("0000000000000001d88000000000000000000000000000000000000000000000");
@@ -327,6 +336,9 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0x00");
 
+        // By default assume that the signatures in ancestors of this block are valid.
+        consensus.defaultAssumeValid = uint256S("0x00");
+
         // Regtest pow limits (use same as main for consistency)
         consensus.pownewlimit = uint256S("0000000000000023CA7500000000000000000000000000000000000000000000");
         consensus.powmaxlimit = uint256S("0000000000000001d88000000000000000000000000000000000000000000000");
@@ -5,32 +5,100 @@
 #ifndef BITCOIN_CHECKQUEUE_H
 #define BITCOIN_CHECKQUEUE_H
 
+#include "utiltime.h"
+
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/** Number of worker threads that get a queue of their own; any further ones share them */
+static const int MAX_CHECKQUEUE_WORKERS = 64;
+/** Number of times an idle worker looks for new work before going to sleep */
+static const int CHECKQUEUE_SPIN_ROUNDS = 1000;
+/** Time a batch of verifications should take, in nanoseconds */
+static const int64_t CHECKQUEUE_TARGET_BATCH_NANOS = 500000;
+
+/** Counters for one round of a CCheckQueue, from the first Add until Wait returns. */
+struct CCheckQueueStats
+{
+    //! verifications performed (those skipped after a failure are not counted)
+    uint64_t nChecks;
+    //! batches taken from the queue of another worker
+    uint64_t nSteals;
+    //! time the master spent waiting for the workers, in microseconds
+    int64_t nWaitMicros;
+    //! batch size in effect at the end of the round
+    unsigned int nBatchSize;
+
+    CCheckQueueStats() : nChecks(0), nSteals(0), nWaitMicros(0), nBatchSize(0) {}
+};
+
+/**
  * Queue for verifications that have to be performed.
-  * The verifications are represented by a type T, which must provide an
-  * operator(), returning a bool.
-  *
-  * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
-  */
+ * The verifications are represented by a type T, which must provide an
+ * operator(), returning a bool.
+ *
+ * One thread (the master) is assumed to push batches of verifications
+ * onto the queue, where they are processed by N-1 worker threads. When
+ * the master is done adding work, it temporarily joins the worker pool
+ * as an N'th worker, until all jobs are done.
+ *
+ * Every worker has its own queue, which Add fills in turn, so workers
+ * rarely contend for a lock. A worker that runs out of work steals half
+ * of another worker's queue. Batches are sized from the observed cost of
+ * a verification, and idle workers poll for a while before they sleep,
+ * as the master usually adds more work shortly.
+ */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    /** The verifications handed to one worker. */
+    struct WorkerQueue
+    {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
+    //! Queue 0 belongs to the master, the others to the workers in the order they started.
+    WorkerQueue vQueues[MAX_CHECKQUEUE_WORKERS + 1];
+
+    //! The number of worker threads that have started.
+    std::atomic<int> nWorkers;
+
+    //! The queue Add hands the next batch to. Only used by the master.
+    unsigned int nNextQueue;
+
+    //! Number of verifications waiting in the queues.
+    std::atomic<unsigned int> nQueued;
+
+    /**
+     * Number of verifications that haven't completed yet.
+     * This includes elements that are no longer queued, but still in the
+     * worker's own batches.
+     */
+    std::atomic<unsigned int> nTodo;
+
+    //! The temporary evaluation result.
+    std::atomic<bool> fAllOk;
+
+    //! Moving average of the time a verification takes, in nanoseconds.
+    std::atomic<int64_t> nCheckNanos;
+
+    //! The maximum number of elements to be processed in one batch
+    unsigned int nBatchSize;
+
+    //! Mutex for sleeping and waking up; the queues have their own.
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,121 +107,200 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    //! The number of workers (including the master) that are idle.
+    //! The number of workers that are asleep. Protected by mutex.
     int nIdle;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! Counters of the current round.
+    std::atomic<uint64_t> nChecks;
+    std::atomic<uint64_t> nSteals;
 
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! Counters of the last completed round. Only used by the master.
+    CCheckQueueStats stats;
+
+    int GetQueueCount() const
+    {
+        return std::min(nWorkers.load(), MAX_CHECKQUEUE_WORKERS) + 1;
+    }
 
     /**
-     * Number of verifications that haven't completed yet.
-     * This includes elements that are no longer queued, but still in the
-     * worker's own batches.
+     * Decide how many work units to process now.
+     * * Aim for batches that take about CHECKQUEUE_TARGET_BATCH_NANOS, so
+     *   that cheap verifications don't spend their time on locking and
+     *   expensive ones are spread over all workers.
+     * * Leave enough queued work for everyone, so all workers finish
+     *   approximately simultaneously.
+     * * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
      */
-    unsigned int nTodo;
+    unsigned int GetBatchSize() const
+    {
+        return std::max(1U, std::min(GetAdaptiveBatchSize(), nQueued.load() / (GetQueueCount() + 1)));
+    }
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    unsigned int GetAdaptiveBatchSize() const
+    {
+        int64_t nCost = std::max((int64_t)1, nCheckNanos.load());
+        return std::max((int64_t)1, std::min((int64_t)nBatchSize, CHECKQUEUE_TARGET_BATCH_NANOS / nCost));
+    }
 
-    //! The maximum number of elements to be processed in one batch
-    unsigned int nBatchSize;
+    /** Move up to nMax verifications out of a queue; half of it at most when stealing. */
+    unsigned int Take(WorkerQueue& q, std::vector<T>& vChecks, unsigned int nMax, bool fSteal)
+    {
+        boost::unique_lock<boost::mutex> lock(q.mutex);
+        unsigned int nNow = std::min((size_t)nMax, fSteal ? (q.queue.size() + 1) / 2 : q.queue.size());
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // Swap jobs to the local batch vector instead of copying. The
+            // owner works from the back, thieves take from the front.
+            if (fSteal) {
+                vChecks[i].swap(q.queue.front());
+                q.queue.pop_front();
+            } else {
+                vChecks[i].swap(q.queue.back());
+                q.queue.pop_back();
+            }
+        }
+        nQueued -= nNow;
+        return nNow;
+    }
 
-    /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    /** Fill vChecks from our own queue, or steal from another one. */
+    bool GetWork(int nSelf, std::vector<T>& vChecks)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+        if (nQueued == 0)
+            return false;
+        unsigned int nMax = GetBatchSize();
+        if (Take(vQueues[nSelf], vChecks, nMax, false))
+            return true;
+        int nQueues = GetQueueCount();
+        for (int i = 1; i < nQueues; i++) {
+            if (Take(vQueues[(nSelf + i) % nQueues], vChecks, nMax, true)) {
+                nSteals++;
+                return true;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while (true);
+        }
+        return false;
+    }
+
+    /** Perform a batch of verifications and account for it. */
+    void Run(std::vector<T>& vChecks)
+    {
+        int64_t nStart = GetTimeMicros();
+        // Check whether we need to do work at all
+        bool fOk = fAllOk;
+        unsigned int nDone = 0;
+        BOOST_FOREACH (T& check, vChecks) {
+            if (!fOk)
+                break;
+            fOk = check();
+            nDone++;
+        }
+        if (!fOk)
+            fAllOk = false;
+        if (nDone) {
+            int64_t nSample = (GetTimeMicros() - nStart) * 1000 / nDone;
+            // Other workers update the average concurrently; retry until
+            // ours is applied on top of the latest value.
+            int64_t nOld = nCheckNanos.load();
+            while (!nCheckNanos.compare_exchange_weak(nOld, (nOld * 7 + nSample) / 8)) {}
+            nChecks += nDone;
+        }
+        unsigned int nNow = vChecks.size();
+        vChecks.clear();
+        if ((nTodo -= nNow) == 0) {
+            // We processed the last element; inform the master it can exit and return the result
+            boost::unique_lock<boost::mutex> lock(mutex);
+            condMaster.notify_one();
+        }
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn) : nWorkers(0), nNextQueue(0), nQueued(0), nTodo(0), fAllOk(true), nCheckNanos(0), nBatchSize(nBatchSizeIn), nIdle(0), nChecks(0), nSteals(0) {}
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        int nSelf = std::min(++nWorkers, MAX_CHECKQUEUE_WORKERS);
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        while (true) {
+            if (GetWork(nSelf, vChecks)) {
+                Run(vChecks);
+                continue;
+            }
+            for (int i = 0; i < CHECKQUEUE_SPIN_ROUNDS && nQueued == 0; i++)
+                boost::this_thread::yield();
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (nQueued == 0) {
+                nIdle++;
+                condWorker.wait(lock); // wait
+                nIdle--;
+            }
+        }
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        int64_t nWaitMicros = 0;
+        while (true) {
+            if (GetWork(0, vChecks)) {
+                Run(vChecks);
+                continue;
+            }
+            if (nTodo == 0)
+                break;
+            // Everything is handed out; wait for the workers to finish it.
+            int64_t nStart = GetTimeMicros();
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nTodo != 0 && nQueued == 0)
+                    condMaster.wait(lock);
+            }
+            nWaitMicros += GetTimeMicros() - nStart;
+        }
+        bool fRet = fAllOk;
+        // reset the status for new work later
+        fAllOk = true;
+        stats.nChecks = nChecks.exchange(0);
+        stats.nSteals = nSteals.exchange(0);
+        stats.nWaitMicros = nWaitMicros;
+        stats.nBatchSize = GetAdaptiveBatchSize();
+        return fRet;
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
+        // Deal the checks out over the queues in equal pieces. They are
+        // counted first, so that nQueued never falls below the real number.
+        int nQueues = GetQueueCount();
+        size_t nChunk = std::max((size_t)1, (vChecks.size() + nQueues - 1) / nQueues);
+        size_t i = 0;
+        while (i < vChecks.size()) {
+            WorkerQueue& q = vQueues[nNextQueue++ % nQueues];
+            size_t nEnd = std::min(vChecks.size(), i + nChunk);
+            nQueued += nEnd - i;
+            {
+                boost::unique_lock<boost::mutex> lock(q.mutex);
+                for (size_t j = i; j < nEnd; j++) {
+                    q.queue.push_back(T());
+                    vChecks[j].swap(q.queue.back());
+                }
+            }
+            i = nEnd;
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nIdle == 0)
+            return;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -163,13 +310,17 @@ public:
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
     }
 
+    //! Counters of the last round completed by Wait.
+    CCheckQueueStats GetStats() const
+    {
+        return stats;
+    }
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
  */
@@ -205,6 +356,14 @@ public:
             pqueue->Add(vChecks);
     }
 
+    //! Counters of the verifications done through this controller, once Wait returned.
+    CCheckQueueStats GetStats() const
+    {
+        if (pqueue == NULL || !fDone)
+            return CCheckQueueStats();
+        return pqueue->GetStats();
+    }
+
     ~CCheckQueueControl()
     {
         if (!fDone)
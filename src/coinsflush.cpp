@@ -0,0 +1,138 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsflush.h"
+
+#include "util.h"
+#include "utiltime.h"
+
+#include <stdexcept>
+
+#include <boost/thread/locks.hpp>
+
+CCoinsViewBackgroundFlush::CCoinsViewBackgroundFlush(CCoinsView *viewIn) : CCoinsViewBacked(viewIn), fPending(false), fRunning(false), fFailed(false) { }
+
+bool CCoinsViewBackgroundFlush::GetCoin(const COutPoint &outpoint, Coin &coin) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs);
+    if (fPending) {
+        CCoinsMap::const_iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end()) {
+            coin = it->second.coin;
+            return !coin.IsSpent();
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewBackgroundFlush::HaveCoin(const COutPoint &outpoint) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs);
+    if (fPending) {
+        CCoinsMap::const_iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end())
+            return !it->second.coin.IsSpent();
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewBackgroundFlush::GetBestBlock() const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs);
+    if (fPending && !hashPending.IsNull())
+        return hashPending;
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewBackgroundFlush::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+{
+    if (!Sync())
+        return false;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        // Swapping hands the caller's entries over without copying them, and
+        // leaves it with the empty map released by the previous write.
+        mapPending.swap(mapCoins);
+        hashPending = hashBlock;
+        fPending = true;
+        if (fRunning) {
+            cond.notify_all();
+            return true;
+        }
+    }
+    return WritePending();
+}
+
+CCoinsViewCursor *CCoinsViewBackgroundFlush::Cursor() const
+{
+    // The cursor iterates over the database itself, so it must be complete.
+    if (!const_cast<CCoinsViewBackgroundFlush*>(this)->Sync())
+        return NULL;
+    return base->Cursor();
+}
+
+bool CCoinsViewBackgroundFlush::Sync()
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs);
+    while (fPending && fRunning && !fFailed)
+        cond.wait(lock);
+    if (fFailed)
+        return false;
+    if (!fPending)
+        return true;
+    // No thread to write it (anymore), so do it here.
+    lock.unlock();
+    return WritePending();
+}
+
+bool CCoinsViewBackgroundFlush::WritePending()
+{
+    int64_t nTimeStart = GetTimeMicros();
+    // Nothing modifies mapPending while fPending is set, so it can be read
+    // here without holding cs while lookups are served from it.
+    size_t nEntries = mapPending.size();
+    bool fOk = false;
+    try {
+        fOk = base->BatchWrite(mapPending, hashPending);
+    } catch (const std::runtime_error& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(cs);
+    if (fOk) {
+        mapPending.clear();
+        fPending = false;
+        LogPrint("coindb", "Flushed %u cache entries for block %s: %.2fms\n", (unsigned int)nEntries, hashPending.ToString(), 0.001 * (GetTimeMicros() - nTimeStart));
+    } else {
+        // Keep serving lookups from the entries, the database no longer matches them.
+        fFailed = true;
+        LogPrintf("%s: failed to write to coin database\n", __func__);
+    }
+    cond.notify_all();
+    return fOk;
+}
+
+void CCoinsViewBackgroundFlush::ThreadFlush()
+{
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        fRunning = true;
+    }
+    try {
+        while (true) {
+            {
+                boost::unique_lock<boost::shared_mutex> lock(cs);
+                while (!fPending || fFailed)
+                    cond.wait(lock);
+            }
+            WritePending();
+        }
+    } catch (...) {
+        // Interrupted; leave whatever is still pending to Sync().
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        fRunning = false;
+        cond.notify_all();
+        throw;
+    }
+}
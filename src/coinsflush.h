@@ -0,0 +1,72 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSFLUSH_H
+#define BITCOIN_COINSFLUSH_H
+
+#include "coins.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+/** Default for -backgroundflush */
+static const bool DEFAULT_BACKGROUND_FLUSH = true;
+
+/**
+ * CCoinsView that sits between the coins cache and the chainstate database
+ * and lets a cache flush return as soon as the dirty entries have been handed
+ * over. A background thread (ThreadFlush) then writes them to the database,
+ * which splits the write into batches of at most -dbbatchsize bytes and marks
+ * the database as being in transition until the last one is written, so an
+ * interrupted write is replayed on the next start.
+ *
+ * Until the write has finished, lookups are answered from the handed over
+ * entries first. Only one flush is in progress at a time: handing over the
+ * next one waits for the previous write to finish. Without a running thread,
+ * flushes are written out synchronously.
+ *
+ * The database must only read the map passed to BatchWrite, as lookups are
+ * served from it concurrently (CCoinsViewDB does).
+ */
+class CCoinsViewBackgroundFlush : public CCoinsViewBacked
+{
+private:
+    //! Guards the members below. Held shared by lookups, exclusively to change them.
+    mutable boost::shared_mutex cs;
+    mutable boost::condition_variable_any cond;
+
+    //! Entries handed over by the last flush, not written to base yet
+    CCoinsMap mapPending;
+    //! Best block of the pending flush
+    uint256 hashPending;
+    //! Whether mapPending and hashPending hold a flush that is still to be written
+    bool fPending;
+    //! Whether ThreadFlush is running
+    bool fRunning;
+    //! Whether a write to base has failed; no further flushes are accepted
+    bool fFailed;
+
+    //! Write the pending flush to base and release it. Requires fPending.
+    bool WritePending();
+
+public:
+    CCoinsViewBackgroundFlush(CCoinsView *viewIn);
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    CCoinsViewCursor *Cursor() const;
+
+    /** Wait until all handed over entries are written. Returns false if a write failed. */
+    bool Sync();
+
+    /** Write out flushes in the background until interrupted. */
+    void ThreadFlush();
+};
+
+#endif // BITCOIN_COINSFLUSH_H
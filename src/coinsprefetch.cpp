@@ -0,0 +1,109 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsprefetch.h"
+
+#include "checkqueue.h"
+#include "primitives/block.h"
+#include "sync.h"
+#include "util.h"
+
+#include <set>
+
+#include <boost/foreach.hpp>
+
+int nCoinsPrefetchBlocks = DEFAULT_COINS_PREFETCH;
+
+static CCriticalSection cs_prefetchStats;
+static CCoinsPrefetchStats prefetchStats;
+
+static CCheckQueue<CCoinsPrefetchRead> prefetchqueue(8);
+
+bool CCoinsPrefetchRead::operator()()
+{
+    result->fFound = view->GetCoin(result->outpoint, result->coin);
+    return true;
+}
+
+void ThreadCoinsPrefetch()
+{
+    RenameThread("bitcoin-prefetch");
+    prefetchqueue.Thread();
+}
+
+void GetBlockInputs(const std::vector<std::shared_ptr<const CBlock> >& vBlocks, std::vector<COutPoint>& vInputs)
+{
+    std::set<uint256> setCreated;
+    std::set<COutPoint> setInputs;
+    BOOST_FOREACH(const std::shared_ptr<const CBlock>& pblock, vBlocks) {
+        BOOST_FOREACH(const CTransaction& tx, pblock->vtx) {
+            if (!tx.IsCoinBase()) {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                    if (!setCreated.count(txin.prevout.hash))
+                        setInputs.insert(txin.prevout);
+                }
+            }
+            setCreated.insert(tx.GetHash());
+        }
+    }
+    vInputs.insert(vInputs.end(), setInputs.begin(), setInputs.end());
+
+    LOCK(cs_prefetchStats);
+    prefetchStats.nBlocks += vBlocks.size();
+}
+
+size_t SelectPrefetchReads(const CCoinsViewCache& cache, const std::vector<COutPoint>& vInputs, std::vector<CCoinsPrefetchResult>& vResults)
+{
+    size_t nCached = 0;
+    BOOST_FOREACH(const COutPoint& prevout, vInputs) {
+        if (cache.HaveCoinInCache(prevout)) {
+            nCached++;
+            continue;
+        }
+        vResults.push_back(CCoinsPrefetchResult());
+        vResults.back().outpoint = prevout;
+    }
+
+    LOCK(cs_prefetchStats);
+    prefetchStats.nHits += nCached;
+    return nCached;
+}
+
+void ReadPrefetchCoins(const CCoinsView& base, std::vector<CCoinsPrefetchResult>& vResults)
+{
+    std::vector<CCoinsPrefetchRead> vReads;
+    vReads.reserve(vResults.size());
+    BOOST_FOREACH(CCoinsPrefetchResult& result, vResults)
+        vReads.push_back(CCoinsPrefetchRead(&base, &result));
+    {
+        // The calling thread joins the readers until all reads are done.
+        CCheckQueueControl<CCoinsPrefetchRead> control(&prefetchqueue);
+        control.Add(vReads);
+        control.Wait();
+    }
+
+    uint64_t nNotFound = 0;
+    BOOST_FOREACH(const CCoinsPrefetchResult& result, vResults) {
+        if (!result.fFound)
+            nNotFound++;
+    }
+
+    LOCK(cs_prefetchStats);
+    prefetchStats.nMisses += vResults.size();
+    prefetchStats.nNotFound += nNotFound;
+}
+
+void AddPrefetchedCoins(CCoinsViewCache& cache, const std::vector<CCoinsPrefetchResult>& vResults)
+{
+    BOOST_FOREACH(const CCoinsPrefetchResult& result, vResults) {
+        if (result.fFound)
+            cache.AddFetchedCoin(result.outpoint, result.coin);
+    }
+}
+
+CCoinsPrefetchStats GetCoinsPrefetchStats()
+{
+    LOCK(cs_prefetchStats);
+    return prefetchStats;
+}
@@ -0,0 +1,108 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSPREFETCH_H
+#define BITCOIN_COINSPREFETCH_H
+
+#include "coins.h"
+#include "uint256.h"
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+
+/** Default for -coinsprefetch, number of blocks ahead of the tip whose inputs are loaded during IBD (0 = off) */
+static const int DEFAULT_COINS_PREFETCH = 16;
+/** Maximum for -coinsprefetch */
+static const int MAX_COINS_PREFETCH = 256;
+/** Number of threads (including the calling one) issuing coins database reads */
+static const int COINS_PREFETCH_THREADS = 4;
+
+/** Number of blocks to prefetch inputs for, as set by -coinsprefetch */
+extern int nCoinsPrefetchBlocks;
+
+/** Prefetch counters, reported by getblockchaininfo. */
+struct CCoinsPrefetchStats
+{
+    //! blocks whose inputs were prefetched
+    uint64_t nBlocks;
+    //! distinct inputs that were already in the coins cache
+    uint64_t nHits;
+    //! distinct inputs that had to be read from the database
+    uint64_t nMisses;
+    //! database reads that found no entry
+    uint64_t nNotFound;
+
+    CCoinsPrefetchStats() : nBlocks(0), nHits(0), nMisses(0), nNotFound(0) {}
+};
+
+/** Outcome of a single prefetch read. */
+struct CCoinsPrefetchResult
+{
+    COutPoint outpoint;
+    Coin coin;
+    bool fFound;
+
+    CCoinsPrefetchResult() : fFound(false) {}
+};
+
+/**
+ * A single coins database read, run by the prefetch threads through a
+ * CCheckQueue. Each read writes to its own result slot, so no locking is
+ * needed on the results.
+ */
+class CCoinsPrefetchRead
+{
+private:
+    const CCoinsView *view;
+    CCoinsPrefetchResult *result;
+
+public:
+    CCoinsPrefetchRead() : view(NULL), result(NULL) {}
+    CCoinsPrefetchRead(const CCoinsView *viewIn, CCoinsPrefetchResult *resultIn) : view(viewIn), result(resultIn) {}
+
+    bool operator()();
+
+    void swap(CCoinsPrefetchRead &read) {
+        std::swap(view, read.view);
+        std::swap(result, read.result);
+    }
+};
+
+/** Run instances of this in the background to service prefetch reads. */
+void ThreadCoinsPrefetch();
+
+/**
+ * Append the distinct outpoints spent by the given blocks to vInputs, in key
+ * order, which is also the order they are laid out in the database. Outputs
+ * created within the given blocks are skipped. Needs no locks.
+ */
+void GetBlockInputs(const std::vector<std::shared_ptr<const CBlock> >& vBlocks, std::vector<COutPoint>& vInputs);
+
+/**
+ * Fill vResults with the inputs cache does not hold yet, and return the
+ * number of inputs it does hold. Call with the lock protecting cache held.
+ */
+size_t SelectPrefetchReads(const CCoinsViewCache& cache, const std::vector<COutPoint>& vInputs, std::vector<CCoinsPrefetchResult>& vResults);
+
+/**
+ * Read the coins for the outpoints in vResults from base in parallel. base
+ * must be safe to read from several threads at once. Only one thread may
+ * call this at a time.
+ */
+void ReadPrefetchCoins(const CCoinsView& base, std::vector<CCoinsPrefetchResult>& vResults);
+
+/**
+ * Add the coins found by ReadPrefetchCoins to cache, which must be backed by
+ * the view they were read from and must not have been flushed since they
+ * were selected. Call with the lock protecting cache held.
+ */
+void AddPrefetchedCoins(CCoinsViewCache& cache, const std::vector<CCoinsPrefetchResult>& vResults);
+
+/** Return a snapshot of the prefetch counters. */
+CCoinsPrefetchStats GetCoinsPrefetchStats();
+
+#endif // BITCOIN_COINSPREFETCH_H
@@ -62,6 +62,8 @@ struct Params {
     int64_t nPowTargetTimespan;
     int64_t DifficultyAdjustmentInterval() const { return nPowTargetTimespan / nPowTargetSpacing; }
     uint256 nMinimumChainWork;
+    /** Scripts in ancestors of this block are assumed valid unless -assumevalid overrides it */
+    uint256 defaultAssumeValid;
     uint256 pownewlimit;
     uint256 powmaxlimit;
     uint256 powdinlimit;
@@ -0,0 +1,95 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// Based on https://github.com/noloader/SHA-Intrinsics/blob/master/sha256-x86.c,
+// Written and placed in public domain by Jeffrey Walton.
+// Based on code from Intel, and by Sean Gulley for the miTLS project.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#ifdef ENABLE_SHANI
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <immintrin.h>
+
+namespace sha256_shani {
+namespace {
+
+static const uint32_t K256[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/** Four rounds of SHA-256 on the message words in msg (without round constants). */
+void inline QuadRound(__m128i& state0, __m128i& state1, __m128i msg, int n)
+{
+    msg = _mm_add_epi32(msg, _mm_load_si128((const __m128i*)(K256 + 4 * n)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+/** Compute the next four message words from the previous sixteen (m0 oldest). */
+__m128i inline ShiftMessage(__m128i m0, __m128i m1, __m128i m2, __m128i m3)
+{
+    return _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4)), m3);
+}
+
+}
+
+/** Perform a number of SHA-256 transformations using the SHA extensions. */
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    // Byte order of the message words
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The instructions keep the state as ABEF and CDGH.
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[0]), 0xb1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[4]), 0x1b); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0); // CDGH
+
+    while (blocks--) {
+        __m128i save0 = state0, save1 = state1;
+        __m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 0)), MASK);
+        __m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 16)), MASK);
+        __m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 32)), MASK);
+        __m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 48)), MASK);
+
+        QuadRound(state0, state1, m0, 0);
+        QuadRound(state0, state1, m1, 1);
+        QuadRound(state0, state1, m2, 2);
+        QuadRound(state0, state1, m3, 3);
+        for (int n = 4; n < 16; n += 4) {
+            m0 = ShiftMessage(m0, m1, m2, m3);
+            QuadRound(state0, state1, m0, n);
+            m1 = ShiftMessage(m1, m2, m3, m0);
+            QuadRound(state0, state1, m1, n + 1);
+            m2 = ShiftMessage(m2, m3, m0, m1);
+            QuadRound(state0, state1, m2, n + 2);
+            m3 = ShiftMessage(m3, m0, m1, m2);
+            QuadRound(state0, state1, m3, n + 3);
+        }
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+        chunk += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b); // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1); // DCHG
+    _mm_storeu_si128((__m128i*)&s[0], _mm_blend_epi16(tmp, state1, 0xf0)); // DCBA
+    _mm_storeu_si128((__m128i*)&s[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+
+}
+
+#endif
@@ -11,19 +11,26 @@
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinsflush.h"
+#include "coinsprefetch.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
+#include "cuckoocache.h"
 #include "hash.h"
 #include "init.h"
+#include "mappedfile.h"
 #include "merkleblock.h"
 #include "net.h"
+#include "parallelranges.h"
 #include "policy/fees.h"
 #include "policy/policy.h"
 #include "pow.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "random.h"
+#include "scheduler.h"
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
@@ -39,10 +46,13 @@
 #include "versionbits.h"
 
 #include <atomic>
+#include <list>
+#include <memory>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/join.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
@@ -67,6 +77,9 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nBlockCheckThreads = 0;
+size_t nBlockServeCacheSize = DEFAULT_BLOCK_SERVE_CACHE * ((size_t)1 << 20);
+bool fMmapBlocks = DEFAULT_MMAP_BLOCKS;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
@@ -76,11 +89,14 @@ bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
+bool fConnectPipeline = DEFAULT_CONNECT_PIPELINE;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
 
+uint256 hashAssumeValid;
+
 
 CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 CAmount maxTxFee = DEFAULT_TRANSACTION_MAXFEE;
@@ -111,6 +127,7 @@ void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
  * in the last Consensus::Params::nMajorityWindow blocks, starting at pstart and going backwards.
  */
 static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& consensusParams);
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& consensusparams);
 static void CheckBlockIndex(const Consensus::Params& consensusParams);
 
 /** Constant stuff for coinbase transactions we create: */
@@ -157,9 +174,23 @@ namespace {
      */
     multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
 
+    /** Owns all entries of mapBlockIndex. */
+    CBlockIndexArena blockIndexArena;
+
+    /** Highest block whose inputs have been prefetched into pcoinsTip. Protected by cs_main. */
+    CBlockIndex* pindexCoinsPrefetched = NULL;
+    /** Blocks read for the coins prefetch that are not connected yet. Protected by cs_main. */
+    std::map<const CBlockIndex*, std::shared_ptr<const CBlock> > mapCoinsPrefetchBlocks;
+    /** Number of times pcoinsTip was flushed or unloaded; coins read before one are stale. Protected by cs_main. */
+    uint64_t nCoinsTipFlushes = 0;
+    /** Held by the one thread running PrefetchCoinsAhead, as the prefetch reads allow a single caller. */
+    CCriticalSection cs_coinsPrefetch;
+
     CCriticalSection cs_LastBlockFile;
     std::vector<CBlockFileInfo> vinfoBlockFile;
     int nLastBlockFile = 0;
+    /** Mappings of finalized block and undo files, used with -mmapblocks. */
+    CMappedFileCache mappedBlockFiles(MAX_MAPPED_BLOCK_FILES);
     /** Global flag to indicate we should check to see if there are
      *  block/undo files that should be deleted.  Set on startup
      *  or if we allocate more file space when we're in prune mode
@@ -215,6 +246,14 @@ namespace {
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+    /**
+     * Blocks that went through the block check threads, per peer, waiting for
+     * the message handler to connect them, with whether to force their
+     * processing. Protected by cs_checkedBlocks.
+     */
+    CCriticalSection cs_checkedBlocks;
+    map<NodeId, vector<pair<std::shared_ptr<CBlock>, bool> > > mapCheckedBlocks;
+
     /** Stack of nodes which we have set to announce using compact blocks */
     list<NodeId> lNodesAnnouncingHeaderAndIDs;
 
@@ -383,6 +422,12 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     }
     EraseOrphansFor(nodeid);
+    {
+        // Checked blocks of a peer that is gone are dropped; they were never
+        // stored, so they get downloaded again from another peer.
+        LOCK(cs_checkedBlocks);
+        mapCheckedBlocks.erase(nodeid);
+    }
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
@@ -696,6 +741,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewBackgroundFlush *pcoinsFlush = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -979,15 +1025,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -1126,9 +1172,9 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
+    std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
 }
 
@@ -1143,7 +1189,7 @@ std::string FormatStateMessage(const CValidationState &state)
 
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
                               bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+                              std::vector<COutPoint>& coins_to_uncache)
 {
     const uint256 hash = tx.GetHash();
     AssertLockHeld(cs_main);
@@ -1243,30 +1289,30 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            COutPoint outpoint(hash, out);
+            bool had_coin_in_cache = pcoinsTip->HaveCoinInCache(outpoint);
+            if (view.HaveCoin(outpoint)) {
+                if (!had_coin_in_cache) {
+                    coins_to_uncache.push_back(outpoint);
+                }
+                return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+            }
         }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
-                if (pfMissingInputs)
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
+                coins_to_uncache.push_back(txin.prevout);
+            }
+            if (!view.HaveCoin(txin.prevout)) {
+                if (pfMissingInputs) {
                     *pfMissingInputs = true;
+                }
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
             }
         }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx))
-            return state.Invalid(false, REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
         // Bring the best block into scope
         view.GetBestBlock();
 
@@ -1308,8 +1354,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1525,12 +1571,12 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, txdata)) {
+        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
-            if (tx.wit.IsNull() && CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) &&
-                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
+            if (tx.wit.IsNull() && CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false, txdata) &&
+                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false, txdata)) {
                 // Only the witness is missing, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
@@ -1546,12 +1592,26 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, false, txdata))
         {
             return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
         }
 
+        // Run the scripts once more with the flags the current tip enforces
+        // and remember the outcome, so that ConnectBlock can skip script
+        // execution entirely when this transaction is mined. The signatures
+        // were all cached above, so this costs little. A failure here can
+        // only come from -promiscuousmempoolflags dropping consensus flags.
+        unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
+        if (!CheckInputs(tx, state, view, true, currentBlockScriptVerifyFlags, true, true, txdata)) {
+            if (!(~scriptVerifyFlags & currentBlockScriptVerifyFlags)) {
+                return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against latest-block but not STANDARD flags %s, %s",
+                    __func__, hash.ToString(), FormatStateMessage(state));
+            }
+            return false;
+        }
+
         // Remove conflicting transactions from the mempool
         BOOST_FOREACH(const CTxMemPool::txiter it, allConflicting)
         {
@@ -1582,10 +1642,10 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    std::vector<COutPoint> coins_to_uncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, coins_to_uncache);
     if (!res) {
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+        BOOST_FOREACH(const COutPoint& hashTx, coins_to_uncache)
             pcoinsTip->Uncache(hashTx);
     }
     return res;
@@ -1629,10 +1689,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
         {
-            const CCoinsViewCache& view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -1685,18 +1744,113 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+/**
+ * With -mmapblocks, locate the record at pos in a finalized block or undo
+ * file, as written by WriteBlockToDisk or UndoWriteToDisk: nSize bytes of
+ * data with the size stored in front, and nTrailer more bytes after it.
+ * Returns the mapping, which must be held while the data is used, or NULL
+ * if the record is to be read from the file.
+ */
+static std::shared_ptr<const CMappedFile> MapDiskRecord(const CDiskBlockPos& pos, const char* prefix, size_t nTrailer, const unsigned char*& pbegin, unsigned int& nSize)
 {
-    block.SetNull();
+    if (!fMmapBlocks || pos.nPos < sizeof(unsigned int))
+        return std::shared_ptr<const CMappedFile>();
+    {
+        // The file still being written to is truncated when it is finalized,
+        // which would pull pages from under a mapping.
+        LOCK(cs_LastBlockFile);
+        if (pos.nFile >= nLastBlockFile)
+            return std::shared_ptr<const CMappedFile>();
+    }
+
+    boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
+    std::shared_ptr<const CMappedFile> pfile = mappedBlockFiles.Get(path, pos.nPos);
+    if (!pfile)
+        return pfile;
+    nSize = ReadLE32(pfile->data() + pos.nPos - sizeof(unsigned int));
+    if (nSize == 0 || nSize > MAX_SIZE)
+        return std::shared_ptr<const CMappedFile>();
+    uint64_t nEnd = (uint64_t)pos.nPos + nSize + nTrailer;
+    if (nEnd > pfile->size()) {
+        // Undo files are appended to after they are finalized.
+        pfile = mappedBlockFiles.Get(path, nEnd);
+        if (!pfile)
+            return pfile;
+    }
+    pbegin = pfile->data() + pos.nPos;
+    return pfile;
+}
+
+/** Read the serialized block at pos into any contiguous char container. */
+template <typename Buffer>
+static bool ReadRawBlock(Buffer& block, const CDiskBlockPos& pos)
+{
+    block.clear();
+    if (pos.nPos < sizeof(unsigned int))
+        return error("%s: invalid position %s", __func__, pos.ToString());
+
+    const unsigned char* pbegin;
+    unsigned int nSize;
+    std::shared_ptr<const CMappedFile> pfile = MapDiskRecord(pos, "blk", 0, pbegin, nSize);
+    if (pfile) {
+        block.assign((const char*)pbegin, (const char*)pbegin + nSize);
+        return true;
+    }
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    // Open history file to read, at the size WriteBlockToDisk stored in front of the block
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - sizeof(unsigned int)), true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    // Read the block in one piece
+    try {
+        unsigned int nSize;
+        filein >> nSize;
+        if (nSize == 0 || nSize > MAX_SIZE)
+            return error("%s: invalid block size %u at %s", __func__, nSize, pos.ToString());
+        block.resize(nSize);
+        filein.read(&block[0], nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
+bool ReadRawBlockFromDisk(std::vector<char>& block, const CDiskBlockPos& pos)
+{
+    return ReadRawBlock(block, pos);
+}
+
+bool ReadRawBlockFromDisk(CSerializeData& block, const CDiskBlockPos& pos)
+{
+    return ReadRawBlock(block, pos);
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+{
+    block.SetNull();
 
     // Read block
+    const unsigned char* pbegin;
+    unsigned int nSize;
+    std::shared_ptr<const CMappedFile> pfile = MapDiskRecord(pos, "blk", 0, pbegin, nSize);
     try {
-        filein >> block;
+        if (pfile) {
+            // Decode it straight from the mapping
+            CMemoryReader reader(SER_DISK, CLIENT_VERSION, (const char*)pbegin, (const char*)pbegin + nSize);
+            reader >> block;
+        } else {
+            // Read the serialized block into memory first, which takes a
+            // single read instead of one per field. A plain vector is used
+            // as the buffer is not worth wiping when it is freed.
+            std::vector<char> vBlock;
+            if (!ReadRawBlockFromDisk(vBlock, pos))
+                return false;
+            CMemoryReader reader(SER_DISK, CLIENT_VERSION, &vBlock[0], &vBlock[0] + vBlock.size());
+            reader >> block;
+        }
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1915,24 +2069,14 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.push_back(Coin());
+            inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(!txundo.vprevout.back().IsSpent());
         }
     }
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -1970,20 +2114,20 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase()) {
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY)
+            if (coin.IsCoinBase()) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY)
                     return state.Invalid(false,
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase",
-                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight));
+                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight));
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
         }
@@ -2003,13 +2147,53 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
+namespace {
+
+/**
+ * Transactions whose scripts all passed with a given set of flags, so that
+ * ConnectBlock doesn't interpret the scripts of transactions it already saw
+ * in the mempool again. Entries are SHA256(nonce || wtxid || flags).
+ * Protected by cs_main.
+ */
+CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
+uint256 scriptExecutionCacheNonce(GetRandHash());
+
+uint256 GetScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 entry;
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(entry.begin());
+    return entry;
+}
+
+} // anon namespace
+
+void InitScriptExecutionCache()
+{
+    // The other half of -maxsigcachesize goes to the signature cache.
+    size_t nMaxCacheSize = std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2) * ((size_t) 1 << 20);
+    size_t nElems = scriptExecutionCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for script execution cache, able to store %zu elements\n",
+            (nElems*sizeof(uint256)) >>20, nMaxCacheSize>>20, nElems);
+}
+
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
         if (!Consensus::CheckTxInputs(tx, state, inputs, GetSpendHeight(inputs)))
             return false;
 
+        // A transaction that already passed with these flags needs no script
+        // checks. Entries consumed by a connected block are marked for
+        // eviction; they will not be needed again.
+        uint256 hashCacheEntry;
+        if (fScriptChecks) {
+            AssertLockHeld(cs_main);
+            hashCacheEntry = GetScriptExecutionCacheEntry(tx, flags);
+            if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore))
+                return true;
+        }
+
         if (pvChecks)
             pvChecks->reserve(tx.vin.size());
 
@@ -2024,13 +2208,14 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // the checkpoint is for a chain that's invalid due to false scriptSigs
         // this optimization would allow an invalid chain to be accepted.
         if (fScriptChecks) {
+            txdata.PrecomputeLegacy(tx);
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheSigStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2042,8 +2227,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
+                        CScriptCheck check2(coin.out, tx, i,
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -2057,6 +2242,12 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Checks handed to the caller haven't run yet, so only inline
+            // results can be remembered.
+            if (cacheFullScriptStore && !pvChecks) {
+                scriptExecutionCache.insert(hashCacheEntry);
+            }
         }
     }
 
@@ -2094,19 +2285,34 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenUndoFile failed", __func__);
-
-    // Read block
     uint256 hashChecksum;
-    try {
-        filein >> blockundo;
-        filein >> hashChecksum;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    const unsigned char* pbegin;
+    unsigned int nSize;
+    std::shared_ptr<const CMappedFile> pfile = MapDiskRecord(pos, "rev", sizeof(hashChecksum), pbegin, nSize);
+    if (pfile) {
+        // Read block from the mapping
+        try {
+            CMemoryReader reader(SER_DISK, CLIENT_VERSION, (const char*)pbegin, (const char*)pbegin + nSize + sizeof(hashChecksum));
+            reader >> blockundo;
+            reader >> hashChecksum;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s", __func__, e.what());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenUndoFile failed", __func__);
+
+        // Read block
+        try {
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Verify checksum
@@ -2140,34 +2346,35 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
+    if (view.HaveCoin(out)) fClean = false; // overwriting transaction output
+
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+        } else {
+            return error("%s: undo data adding output to missing transaction", __func__);
+        }
     }
-    if (coins->IsAvailable(out.n))
-        fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    // The potential_overwrite parameter to AddCoin is only allowed to be false if we know for
+    // sure that the coin did not already exist in the cache. As we have queried for that above
+    // using HaveCoin, we don't need to guess. When fClean is false, a coin already existed and
+    // it is an overwrite.
+    view.AddCoin(out, std::move(undo), !fClean);
 
     return fClean;
 }
@@ -2198,34 +2405,28 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                view.SpendCoin(out, &coin);
+                if (tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight || tx.IsCoinBase() != (bool)coin.fCoinBase) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+            }
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out))
                     fClean = false;
             }
+            // At this point, all of txundo.vprevout should have been moved out.
         }
     }
 
@@ -2272,6 +2473,13 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/** Pool running the context-free checks of blocks received during IBD. */
+static CScheduler blockcheckpool;
+
+void ThreadBlockCheck() {
+    blockcheckpool.serviceQueue();
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2319,12 +2527,78 @@ static ThresholdConditionCache warningcache[VERSIONBITS_NUM_BITS];
 
 static int64_t nTimeCheck = 0;
 static int64_t nTimeForks = 0;
+static int64_t nTimePipeline = 0;
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+/** Script verification flags enforced for the block at pindex (whose nVersion is the block's). */
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& consensusparams)
+{
+    // BIP16 didn't become active until Apr 1 2012
+    int64_t nBIP16SwitchTime = 1333238400;
+    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
+    // when 75% of the network has upgraded:
+    if (pindex->nVersion >= 3 && IsSuperMajority(3, pindex->pprev, consensusparams.nMajorityEnforceBlockUpgrade, consensusparams)) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
+    // blocks, when 75% of the network has upgraded:
+    if (pindex->nVersion >= 4 && IsSuperMajority(4, pindex->pprev, consensusparams.nMajorityEnforceBlockUpgrade, consensusparams)) {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    // Start enforcing BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    if (VersionBitsState(pindex->pprev, consensusparams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
+        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    }
+
+    // Start enforcing WITNESS rules using versionbits logic.
+    if (IsWitnessEnabled(pindex->pprev, consensusparams)) {
+        flags |= SCRIPT_VERIFY_WITNESS;
+        flags |= SCRIPT_VERIFY_NULLDUMMY;
+    }
+
+    return flags;
+}
+
+/**
+ * Build the script checks for a transaction ahead of the serial connect pass,
+ * provided every input spends an output that already exists in the view and
+ * was not created earlier in the same block. The contextual input checks
+ * (amounts, maturity, double spends) are still done by CheckInputs later on;
+ * this only moves signature verification off the critical path.
+ */
+static bool QueuePrefetchedScriptChecks(const CTransaction& tx, const CCoinsViewCache& view, const std::set<uint256>& setBlockTxids,
+                                        unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>& vChecks)
+{
+    // Already validated with these flags (typically in the mempool): there
+    // is nothing to queue.
+    if (scriptExecutionCache.contains(GetScriptExecutionCacheEntry(tx, flags), !cacheStore))
+        return true;
+    vChecks.reserve(tx.vin.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const COutPoint &prevout = tx.vin[i].prevout;
+        if (setBlockTxids.count(prevout.hash))
+            return false;
+        const Coin& coin = view.AccessCoin(prevout);
+        if (coin.IsSpent())
+            return false;
+        vChecks.push_back(CScriptCheck());
+        CScriptCheck check(coin.out, tx, i, flags, cacheStore, &txdata);
+        check.swap(vChecks.back());
+    }
+    txdata.PrecomputeLegacy(tx);
+    return true;
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
                   CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
 {
@@ -2332,8 +2606,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     int64_t nTimeStart = GetTimeMicros();
 
-    // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in, unless
+    // the checks already passed for the data we stored for it this session.
+    if (!pindex->fChecked && !CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck))
         return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
 
     // verify that the view's current state corresponds to the previous block
@@ -2356,6 +2631,30 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             fScriptChecks = false;
         }
     }
+    if (fScriptChecks && !hashAssumeValid.IsNull()) {
+        // We've been configured with the hash of a block which has been externally verified to have a valid history.
+        // A suitable default value is included with the software and updated from time to time.  Because validity
+        //  relative to a piece of software is an objective fact these defaults can be easily reviewed.
+        // This setting doesn't force the selection of any particular chain but makes validating some faster by
+        //  effectively caching the result of part of the verification.
+        BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+        if (it != mapBlockIndex.end()) {
+            if (it->second->GetAncestor(pindex->nHeight) == pindex &&
+                pindexBestHeader->GetAncestor(pindex->nHeight) == pindex &&
+                pindexBestHeader->nChainWork >= UintToArith256(chainparams.GetConsensus().nMinimumChainWork)) {
+                // This block is a member of the assumed verified chain and an ancestor of the best header.
+                // The equivalent time check discourages hashpower from extorting the network via DOS attack
+                //  into accepting an invalid block through telling users they must manually set assumevalid.
+                //  Requiring a software change or burying the invalid block, regardless of the setting, makes
+                //  it hard to hide the implication of the demand.  This also avoids having release candidates
+                //  that are hardly doing any signature verification at all in testing without having to
+                //  artificially set the default assumed verified block further back.
+                // The test against nMinimumChainWork prevents the skipping when denied access to any chain at
+                //  least as good as the expected chain.
+                fScriptChecks = (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, chainparams.GetConsensus()) <= 60 * 60 * 24 * 7 * 2);
+            }
+        }
+    }
 
     int64_t nTime1 = GetTimeMicros(); nTimeCheck += nTime1 - nTimeStart;
     LogPrint("bench", "    - Sanity checks: %.2fms [%.2fs]\n", 0.001 * (nTime1 - nTimeStart), nTimeCheck * 0.000001);
@@ -2405,44 +2704,23 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o))) {
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+                }
+            }
         }
     }
 
-    // BIP16 didn't become active until Apr 1 2012
-    int64_t nBIP16SwitchTime = 1333238400;
-    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
-
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
-
-    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
-    // when 75% of the network has upgraded:
-    if (block.nVersion >= 3 && IsSuperMajority(3, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
-
-    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
-    // blocks, when 75% of the network has upgraded:
-    if (block.nVersion >= 4 && IsSuperMajority(4, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
+    unsigned int flags = GetBlockScriptFlags(pindex, chainparams.GetConsensus());
 
-    // Start enforcing BIP68 (sequence locks) and BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    // Start enforcing BIP68 (sequence locks) using versionbits logic.
     int nLockTimeFlags = 0;
     if (VersionBitsState(pindex->pprev, chainparams.GetConsensus(), Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
-        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
         nLockTimeFlags |= LOCKTIME_VERIFY_SEQUENCE;
     }
 
-    // Start enforcing WITNESS rules using versionbits logic.
-    if (IsWitnessEnabled(pindex->pprev, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_WITNESS;
-        flags |= SCRIPT_VERIFY_NULLDUMMY;
-    }
-
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
     LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
 
@@ -2461,6 +2739,33 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        txdata.emplace_back(tx);
+
+    // Pipelined connection: resolve the inputs of every transaction that only
+    // spends outputs created before this block and hand its script checks to
+    // the verification threads right away. The workers then verify while we
+    // keep walking the coins cache, instead of waiting for the serial pass
+    // below. Transactions spending outputs of this block are left to that pass.
+    std::vector<bool> vScriptsQueued(block.vtx.size(), false);
+    if (fScriptChecks && nScriptCheckThreads && fConnectPipeline) {
+        unsigned int nQueued = 0;
+        std::set<uint256> setBlockTxids;
+        setBlockTxids.insert(block.vtx[0].GetHash());
+        for (unsigned int i = 1; i < block.vtx.size(); i++) {
+            const CTransaction &tx = block.vtx[i];
+            std::vector<CScriptCheck> vChecks;
+            if (QueuePrefetchedScriptChecks(tx, view, setBlockTxids, flags, fJustCheck, txdata[i], vChecks)) {
+                control.Add(vChecks);
+                vScriptsQueued[i] = true;
+                nQueued++;
+            }
+            setBlockTxids.insert(tx.GetHash());
+        }
+        int64_t nTimePipe = GetTimeMicros(); nTimePipeline += nTimePipe - nTime2;
+        LogPrint("bench", "      - Pipeline %u/%u transactions: %.2fms [%.2fs]\n", nQueued, (unsigned)block.vtx.size() - 1, 0.001 * (nTimePipe - nTime2), nTimePipeline * 0.000001);
+    }
+
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
@@ -2478,7 +2783,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             // be in ConnectBlock because they require the UTXO set
             prevheights.resize(tx.vin.size());
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
+                prevheights[j] = view.AccessCoin(tx.vin[j].prevout).nHeight;
             }
 
             // Which orphan pool entries must we evict?
@@ -2507,14 +2812,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             return state.DoS(100, error("ConnectBlock(): too many sigops"),
                              REJECT_INVALID, "bad-blk-sigops");
 
-        txdata.emplace_back(tx);
         if (!tx.IsCoinBase())
         {
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks && !vScriptsQueued[i], flags, fCacheResults, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
@@ -2543,6 +2847,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return state.DoS(100, false);
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
+    CCheckQueueStats checkStats = control.GetStats();
+    LogPrint("bench", "      - Script check threads: %u checks, %u steals, batch %u, %.2fms waiting\n", checkStats.nChecks, checkStats.nSteals, checkStats.nBatchSize, 0.001 * checkStats.nWaitMicros);
 
     if (fJustCheck)
         return true;
@@ -2676,23 +2982,33 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 return AbortNode(state, "Files to write to block index database");
             }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
-            UnlinkPrunedFiles(setFilesToPrune);
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // With a background flusher this only hands the dirty entries over;
+        // wait for them to reach the database when shutting down or before
+        // deleting block files a restart could otherwise need for replaying.
+        int64_t nTimeFlushStart = GetTimeMicros();
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // The flush emptied the cache, prefetched coins included.
+        pindexCoinsPrefetched = NULL;
+        nCoinsTipFlushes++;
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && pcoinsFlush && !pcoinsFlush->Sync())
+            return AbortNode(state, "Failed to write to coin database");
+        LogPrint("bench", "    - Flush chainstate: %.2fms\n", 0.001 * (GetTimeMicros() - nTimeFlushStart));
+        // Finally remove any pruned files
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -2848,7 +3164,15 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
-    if (!pblock) {
+    std::shared_ptr<const CBlock> pblockPrefetched;
+    std::map<const CBlockIndex*, std::shared_ptr<const CBlock> >::iterator itPrefetched = mapCoinsPrefetchBlocks.find(pindexNew);
+    if (itPrefetched != mapCoinsPrefetchBlocks.end()) {
+        pblockPrefetched = itPrefetched->second;
+        mapCoinsPrefetchBlocks.erase(itPrefetched);
+    }
+    if (!pblock && pblockPrefetched) {
+        pblock = pblockPrefetched.get();
+    } else if (!pblock) {
         if (!ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
             return AbortNode(state, "Failed to read block");
         pblock = &block;
@@ -2969,6 +3293,109 @@ static void PruneBlockIndexCandidates() {
     assert(!setBlockIndexCandidates.empty());
 }
 
+/**
+ * During initial block download, load the coins spent by the next
+ * -coinsprefetch blocks towards pindexMostWork (or the best header if it is
+ * NULL) that are already on disk into pcoinsTip, so connecting them does not
+ * wait on one database read at a time. The window is refilled once half of
+ * it has been connected. The blocks read are kept in mapCoinsPrefetchBlocks
+ * for ConnectTip, so each is read from disk only once.
+ *
+ * Called without cs_main: blocks and coins are read without the lock, which
+ * is only taken to pick the window, select the coins not cached yet, and
+ * merge the results. Coins read across a flush of pcoinsTip are dropped.
+ */
+static void PrefetchCoinsAhead(const CChainParams& chainparams, CBlockIndex* pindexMostWork)
+{
+    TRY_LOCK(cs_coinsPrefetch, lockPrefetch);
+    if (!lockPrefetch)
+        return;
+
+    // Pick the blocks to prefetch, taking those already read from the map.
+    std::vector<CBlockIndex*> vpindex;
+    std::vector<std::shared_ptr<const CBlock> > vBlocks;
+    std::vector<CDiskBlockPos> vPos;
+    {
+        LOCK(cs_main);
+        if (nCoinsPrefetchBlocks <= 0 || !IsInitialBlockDownload()) {
+            mapCoinsPrefetchBlocks.clear();
+            return;
+        }
+        CBlockIndex* pindexTarget = pindexMostWork ? pindexMostWork : pindexBestHeader;
+        int nTipHeight = chainActive.Height();
+        if (!pindexTarget || pindexTarget->nHeight <= nTipHeight || pindexTarget->GetAncestor(nTipHeight) != chainActive.Tip())
+            return;
+        if (pindexCoinsPrefetched && (pindexCoinsPrefetched->nHeight <= nTipHeight ||
+                                      pindexTarget->GetAncestor(pindexCoinsPrefetched->nHeight) != pindexCoinsPrefetched)) {
+            pindexCoinsPrefetched = NULL;
+            mapCoinsPrefetchBlocks.clear();
+        }
+        int nStartHeight = pindexCoinsPrefetched ? pindexCoinsPrefetched->nHeight : nTipHeight;
+        if (nStartHeight - nTipHeight > nCoinsPrefetchBlocks / 2)
+            return;
+        int nEndHeight = std::min(nTipHeight + nCoinsPrefetchBlocks, pindexTarget->nHeight);
+        for (int nHeight = nStartHeight + 1; nHeight <= nEndHeight; nHeight++) {
+            CBlockIndex* pindex = pindexTarget->GetAncestor(nHeight);
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                break;
+            // Blocks still kept from before a flush dropped their coins are not read again.
+            std::map<const CBlockIndex*, std::shared_ptr<const CBlock> >::const_iterator it = mapCoinsPrefetchBlocks.find(pindex);
+            vpindex.push_back(pindex);
+            vBlocks.push_back(it != mapCoinsPrefetchBlocks.end() ? it->second : std::shared_ptr<const CBlock>());
+            vPos.push_back(pindex->GetBlockPos());
+        }
+    }
+
+    int64_t nTimeStart = GetTimeMicros();
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        if (vBlocks[i])
+            continue;
+        std::shared_ptr<CBlock> pblock(new CBlock());
+        if (!ReadBlockFromDisk(*pblock, vPos[i], chainparams.GetConsensus())) {
+            vpindex.resize(i);
+            vBlocks.resize(i);
+            break;
+        }
+        vBlocks[i] = pblock;
+    }
+    if (vBlocks.empty())
+        return;
+    std::vector<COutPoint> vInputs;
+    GetBlockInputs(vBlocks, vInputs);
+
+    std::vector<CCoinsPrefetchResult> vResults;
+    size_t nCached;
+    uint64_t nFlushes;
+    const CCoinsViewCache* pcoinsSelected;
+    {
+        LOCK(cs_main);
+        nCached = SelectPrefetchReads(*pcoinsTip, vInputs, vResults);
+        nFlushes = nCoinsTipFlushes;
+        pcoinsSelected = pcoinsTip;
+    }
+    // The backend is only replaced together with pcoinsTip while loading the
+    // block index, when nothing is being connected.
+    ReadPrefetchCoins(pcoinsSelected->GetBackend(), vResults);
+
+    bool fMerged = false;
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < vBlocks.size(); i++) {
+            if (!chainActive.Contains(vpindex[i]))
+                mapCoinsPrefetchBlocks[vpindex[i]] = vBlocks[i];
+        }
+        if (nFlushes == nCoinsTipFlushes && pcoinsSelected == pcoinsTip) {
+            AddPrefetchedCoins(*pcoinsTip, vResults);
+            if (vpindex.back()->nHeight > chainActive.Height())
+                pindexCoinsPrefetched = vpindex.back();
+            fMerged = true;
+        }
+    }
+
+    LogPrint("bench", "  - Prefetch inputs of %u blocks: %u cached, %u read%s: %.2fms\n",
+        (unsigned)vBlocks.size(), (unsigned)nCached, (unsigned)vResults.size(), fMerged ? "" : " (dropped after a flush)", 0.001 * (GetTimeMicros() - nTimeStart));
+}
+
 /**
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
@@ -3090,6 +3517,8 @@ bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams,
         if (ShutdownRequested())
             break;
 
+        PrefetchCoinsAhead(chainparams, pindexMostWork);
+
         const CBlockIndex *pindexFork;
         bool fInitialDownload;
         int nNewHeight;
@@ -3247,8 +3676,8 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    *pindexNew = CBlockIndex(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3787,6 +4216,7 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
                 AbortNode(state, "Failed to write block");
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
+        pindex->fChecked = block.fChecked;
     } catch (const std::runtime_error& e) {
         return AbortNode(state, std::string("System error: ") + e.what());
     }
@@ -3915,6 +4345,8 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        mappedBlockFiles.Erase(GetBlockPosFilename(pos, "blk"));
+        mappedBlockFiles.Erase(GetBlockPosFilename(pos, "rev"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4027,65 +4459,412 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error(std::string(__func__) + ": new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+/** Apply the effects of a block on the utxo cache, ignoring that it may already have been applied. */
+static bool RollforwardBlock(const CBlockIndex* pindex, CCoinsViewCache& inputs, const CChainParams& params)
 {
-    const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
-        return false;
-
-    boost::this_thread::interruption_point();
-
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, params.GetConsensus())) {
+        return error("RollforwardBlock(): ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        // We can link the chain of blocks for which we've received transactions at some point.
-        // Pruned nodes may have deleted the block.
-        if (pindex->nTx > 0) {
-            if (pindex->pprev) {
-                if (pindex->pprev->nChainTx) {
-                    pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
-                } else {
-                    pindex->nChainTx = 0;
-                    mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
-                }
-            } else {
-                pindex->nChainTx = pindex->nTx;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                inputs.SpendCoin(txin.prevout);
             }
         }
-        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
-            setBlockIndexCandidates.insert(pindex);
-        if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
-            pindexBestInvalid = pindex;
-        if (pindex->pprev)
-            pindex->BuildSkip();
-        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
-            pindexBestHeader = pindex;
+        // Pass check = true as every addition may be an overwrite.
+        AddCoins(inputs, tx, pindex->nHeight, true);
     }
+    return true;
+}
 
-    // Load block file info
-    pblocktree->ReadLastBlockFile(nLastBlockFile);
-    vinfoBlockFile.resize(nLastBlockFile + 1);
-    LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
-    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
+/**
+ * Bring a chainstate whose last flush was interrupted back to a consistent
+ * state, by rolling back the blocks of the old tip's branch and rolling
+ * forward to the new tip. Both writing and deleting a coin are idempotent,
+ * so blocks whose effects were partially written can be applied again.
+ */
+static bool ReplayBlocks(const CChainParams& params, CCoinsViewCache& view)
+{
+    LOCK(cs_main);
+
+    std::vector<uint256> hashHeads = view.GetHeadBlocks();
+    if (hashHeads.empty()) return true; // We're already in a consistent state.
+    if (hashHeads.size() != 2) return error("ReplayBlocks(): unknown inconsistent state");
+
+    uiInterface.ShowProgress(_("Replaying blocks..."), 0);
+    LogPrintf("Replaying blocks\n");
+
+    CBlockIndex* pindexOld = NULL;  // Old tip during the interrupted flush.
+    CBlockIndex* pindexNew;         // New tip during the interrupted flush.
+    CBlockIndex* pindexFork = NULL; // Latest block common to both the old and the new tip.
+
+    if (mapBlockIndex.count(hashHeads[0]) == 0) {
+        return error("ReplayBlocks(): reorganization to unknown block requested");
+    }
+    pindexNew = mapBlockIndex[hashHeads[0]];
+
+    if (!hashHeads[1].IsNull()) { // The old tip is allowed to be 0, indicating it's the first flush.
+        if (mapBlockIndex.count(hashHeads[1]) == 0) {
+            return error("ReplayBlocks(): reorganization from unknown block requested");
+        }
+        pindexOld = mapBlockIndex[hashHeads[1]];
+        pindexFork = LastCommonAncestor(pindexOld, pindexNew);
+        assert(pindexFork != NULL);
+    }
+
+    // Rollback along the old branch.
+    while (pindexOld != pindexFork) {
+        if (pindexOld->nHeight > 0) { // Never disconnect the genesis block.
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexOld, params.GetConsensus())) {
+                return error("ReplayBlocks(): ReadBlockFromDisk() failed at %d, hash=%s", pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+            }
+            LogPrintf("Rolling back %s (%i)\n", pindexOld->GetBlockHash().ToString(), pindexOld->nHeight);
+            // If the disconnect is unclean, it means a non-existing coin was
+            // deleted or an existing one overwritten, as the block never had
+            // all its changes written. The result is still the utxo set with
+            // the effects of the block undone.
+            CValidationState state;
+            bool fClean;
+            view.SetBestBlock(pindexOld->GetBlockHash());
+            if (!DisconnectBlock(block, state, pindexOld, view, &fClean)) {
+                return error("ReplayBlocks(): DisconnectBlock failed at %d, hash=%s", pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+            }
+        }
+        pindexOld = pindexOld->pprev;
+    }
+
+    // Roll forward from the forking point to the new tip.
+    int nForkHeight = pindexFork ? pindexFork->nHeight : 0;
+    for (int nHeight = nForkHeight + 1; nHeight <= pindexNew->nHeight; ++nHeight) {
+        const CBlockIndex* pindex = pindexNew->GetAncestor(nHeight);
+        LogPrintf("Rolling forward %s (%i)\n", pindex->GetBlockHash().ToString(), nHeight);
+        uiInterface.ShowProgress(_("Replaying blocks..."), (int) ((nHeight - nForkHeight) * 100.0 / (pindexNew->nHeight - nForkHeight)));
+        if (!RollforwardBlock(pindex, view, params)) return false;
+    }
+
+    view.SetBestBlock(pindexNew->GetBlockHash());
+    bool fOk = view.Flush();
+    uiInterface.ShowProgress("", 100);
+    return fOk;
+}
+
+namespace {
+
+static const uint32_t BLOCK_INDEX_SNAPSHOT_VERSION = 2;
+static const uint32_t BLOCK_INDEX_SNAPSHOT_NO_PREV = 0xffffffff;
+
+boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "index.snapshot";
+}
+
+/**
+ * One block index entry in the snapshot file: the fields of CDiskBlockIndex
+ * plus the hash and chain work, all fixed size. pprev is stored as the
+ * position of the parent in the file, which always precedes the entry.
+ */
+class CBlockIndexSnapshotEntry
+{
+public:
+    uint256 hash;
+    uint32_t nPrev;
+    int32_t nHeight;
+    uint32_t nStatus;
+    uint32_t nTx;
+    int32_t nFile;
+    uint32_t nDataPos;
+    uint32_t nUndoPos;
+    int32_t nVersion;
+    uint256 hashMerkleRoot;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+    uint256 nChainWork;
+
+    CBlockIndexSnapshotEntry() {}
+
+    CBlockIndexSnapshotEntry(const CBlockIndex& index, uint32_t nPrevIn) :
+        hash(index.GetBlockHash()), nPrev(nPrevIn), nHeight(index.nHeight), nStatus(index.nStatus), nTx(index.nTx),
+        nFile(index.nFile), nDataPos(index.nDataPos), nUndoPos(index.nUndoPos), nVersion(index.nVersion),
+        hashMerkleRoot(index.hashMerkleRoot), nTime(index.nTime), nBits(index.nBits), nNonce(index.nNonce),
+        nChainWork(ArithToUint256(index.nChainWork)) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hash);
+        READWRITE(nPrev);
+        READWRITE(nHeight);
+        READWRITE(nStatus);
+        READWRITE(nTx);
+        READWRITE(nFile);
+        READWRITE(nDataPos);
+        READWRITE(nUndoPos);
+        READWRITE(this->nVersion);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nTime);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+        READWRITE(nChainWork);
+    }
+};
+
+} // anon namespace
+
+bool WriteBlockIndexSnapshot()
+{
+    AssertLockHeld(cs_main);
+    int64_t nStart = GetTimeMillis();
+
+    // The snapshot must match the block tree database exactly.
+    if (fReindex || fImporting || !setDirtyBlockIndex.empty() || chainActive.Tip() == NULL || pcoinsTip == NULL ||
+        pcoinsTip->GetBestBlock() != chainActive.Tip()->GetBlockHash())
+        return false;
+
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".new";
+    CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s: Failed to open file %s", __func__, pathTmp.string());
+
+    // Also recorded in the block tree database, where any later write of
+    // block index entries erases it.
+    uint256 snapshotId = GetRandHash();
+    try {
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        uint256 hashBestChain = chainActive.Tip()->GetBlockHash();
+        uint64_t nEntries = vSortedByHeight.size();
+        fileout << FLATDATA(Params().MessageStart()) << BLOCK_INDEX_SNAPSHOT_VERSION << hashBestChain << snapshotId << nEntries;
+        hasher << FLATDATA(Params().MessageStart()) << BLOCK_INDEX_SNAPSHOT_VERSION << hashBestChain << snapshotId << nEntries;
+
+        map<const CBlockIndex*, uint32_t> mapPosition;
+        for (size_t i = 0; i < vSortedByHeight.size(); i++) {
+            const CBlockIndex* pindex = vSortedByHeight[i].second;
+            uint32_t nPrev = BLOCK_INDEX_SNAPSHOT_NO_PREV;
+            if (pindex->pprev) {
+                map<const CBlockIndex*, uint32_t>::const_iterator it = mapPosition.find(pindex->pprev);
+                if (it == mapPosition.end())
+                    return error("%s: parent of %s not found", __func__, pindex->GetBlockHash().ToString());
+                nPrev = it->second;
+            }
+            mapPosition[pindex] = i;
+            CBlockIndexSnapshotEntry entry(*pindex, nPrev);
+            fileout << entry;
+            hasher << entry;
+        }
+        fileout << hasher.GetHash();
+        FileCommit(fileout.Get());
+        fileout.fclose();
+    } catch (const std::exception& e) {
+        return error("%s: Serialize or I/O error - %s", __func__, e.what());
+    }
+
+    if (!RenameOver(pathTmp, path))
+        return error("%s: Rename-into-place failed", __func__);
+    if (!pblocktree->WriteSnapshotId(snapshotId))
+        return error("%s: Failed to write snapshot id to the block index database", __func__);
+
+    LogPrintf("Wrote block index snapshot with %u entries: %dms\n", vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+/** Whether the block index was last loaded from the snapshot. Protected by cs_main. */
+static bool fBlockIndexFromSnapshot = false;
+
+bool IsBlockIndexFromSnapshot()
+{
+    AssertLockHeld(cs_main);
+    return fBlockIndexFromSnapshot;
+}
+
+/** Check that the given entries hash to their own hash and satisfy their proof of work, like LoadBlockIndexGuts does. */
+static void CheckBlockIndexRange(const vector<pair<int, CBlockIndex*> >& vSortedByHeight, std::vector<unsigned char>& vOk, size_t nBegin, size_t nEnd)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    for (size_t i = nBegin; i < nEnd; i++) {
+        const CBlockIndex* pindex = vSortedByHeight[i].second;
+        vOk[i] = pindex->GetBlockHeader().GetHash() == pindex->GetBlockHash() &&
+                 CheckProofOfWork(pindex->GetBlockHash(), pindex->nBits, consensusParams);
+    }
+}
+
+/**
+ * Load the block index from the snapshot written at the last clean shutdown,
+ * including the chain work of every entry. Fills vSortedByHeight like
+ * LoadBlockIndexDB does. Leaves the index empty and returns false if there is
+ * no usable snapshot.
+ */
+static bool LoadBlockIndexSnapshot(vector<pair<int, CBlockIndex*> >& vSortedByHeight)
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+
+    uint256 snapshotIdDB;
+    if (!pblocktree->ReadSnapshotId(snapshotIdDB))
+        snapshotIdDB.SetNull();
+
+    bool fOk = false;
+    try {
+        CHashVerifier<CAutoFile> verifier(&filein);
+        unsigned char pchMsgTmp[4];
+        uint32_t nVersion;
+        uint256 hashBestChain;
+        uint256 snapshotId;
+        uint64_t nEntries;
+        verifier >> FLATDATA(pchMsgTmp) >> nVersion >> hashBestChain >> snapshotId >> nEntries;
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)) || nVersion != BLOCK_INDEX_SNAPSHOT_VERSION) {
+            LogPrintf("%s: snapshot is for another network or version\n", __func__);
+        } else if (hashBestChain != pcoinsTip->GetBestBlock()) {
+            LogPrintf("%s: snapshot is stale\n", __func__);
+        } else if (snapshotId != snapshotIdDB) {
+            LogPrintf("%s: snapshot does not match the block index database\n", __func__);
+        } else {
+            vSortedByHeight.reserve(nEntries);
+            for (uint64_t i = 0; i < nEntries; i++) {
+                boost::this_thread::interruption_point();
+                CBlockIndexSnapshotEntry entry;
+                verifier >> entry;
+                if (entry.nPrev != BLOCK_INDEX_SNAPSHOT_NO_PREV && entry.nPrev >= i)
+                    throw std::runtime_error("parent out of order");
+                CBlockIndex* pindexNew = InsertBlockIndex(entry.hash);
+                pindexNew->pprev          = entry.nPrev == BLOCK_INDEX_SNAPSHOT_NO_PREV ? NULL : vSortedByHeight[entry.nPrev].second;
+                pindexNew->nHeight        = entry.nHeight;
+                pindexNew->nFile          = entry.nFile;
+                pindexNew->nDataPos       = entry.nDataPos;
+                pindexNew->nUndoPos       = entry.nUndoPos;
+                pindexNew->nVersion       = entry.nVersion;
+                pindexNew->hashMerkleRoot = entry.hashMerkleRoot;
+                pindexNew->nTime          = entry.nTime;
+                pindexNew->nBits          = entry.nBits;
+                pindexNew->nNonce         = entry.nNonce;
+                pindexNew->nStatus        = entry.nStatus;
+                pindexNew->nTx            = entry.nTx;
+                pindexNew->nChainWork     = UintToArith256(entry.nChainWork);
+                vSortedByHeight.push_back(make_pair(pindexNew->nHeight, pindexNew));
+            }
+            uint256 hashChecksum;
+            filein >> hashChecksum;
+            if (hashChecksum != verifier.GetHash())
+                LogPrintf("%s: checksum mismatch, snapshot corrupted\n", __func__);
+            else if (mapBlockIndex.size() != nEntries)
+                LogPrintf("%s: snapshot contains duplicate entries\n", __func__);
+            else
+                fOk = true;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+    }
+
+    if (fOk) {
+        std::vector<unsigned char> vOk(vSortedByHeight.size());
+        ParallelForRanges(vSortedByHeight.size(), boost::bind(&CheckBlockIndexRange, boost::cref(vSortedByHeight), boost::ref(vOk), _1, _2));
+        for (size_t i = 0; i < vOk.size() && fOk; i++) {
+            if (!vOk[i]) {
+                LogPrintf("%s: hash or proof of work check failed: %s\n", __func__, vSortedByHeight[i].second->ToString());
+                fOk = false;
+            }
+        }
+    }
+
+    if (!fOk) {
+        vSortedByHeight.clear();
+        mapBlockIndex.clear();
+        blockIndexArena.Clear();
+        return false;
+    }
+    LogPrintf("Loaded block index snapshot with %u entries: %dms\n", vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+/** Set nChainWork of the given entries to the work of the block alone. */
+static void SetBlockProofRange(const vector<pair<int, CBlockIndex*> >& vSortedByHeight, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        CBlockIndex* pindex = vSortedByHeight[i].second;
+        pindex->nChainWork = GetBlockProof(*pindex);
+    }
+}
+
+bool static LoadBlockIndexDB()
+{
+    const CChainParams& chainparams = Params();
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    // The snapshot already holds the linked entries in height order, with their chain work.
+    bool fSnapshot = GetBoolArg("-blockindexsnapshot", DEFAULT_BLOCK_INDEX_SNAPSHOT) && LoadBlockIndexSnapshot(vSortedByHeight);
+    fBlockIndexFromSnapshot = fSnapshot;
+    if (!fSnapshot) {
+        if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        // Calculate nChainWork
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+        // The work of each block on its own doesn't depend on its ancestors, so
+        // compute that in parallel and only sum it up along the chain below.
+        ParallelForRanges(vSortedByHeight.size(), boost::bind(&SetBlockProofRange, boost::cref(vSortedByHeight), _1, _2));
+    }
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        CBlockIndex* pindex = item.second;
+        if (!fSnapshot)
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->nChainWork;
+        // We can link the chain of blocks for which we've received transactions at some point.
+        // Pruned nodes may have deleted the block.
+        if (pindex->nTx > 0) {
+            if (pindex->pprev) {
+                if (pindex->pprev->nChainTx) {
+                    pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+                } else {
+                    pindex->nChainTx = 0;
+                    mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
+                }
+            } else {
+                pindex->nChainTx = pindex->nTx;
+            }
+        }
+        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
+            setBlockIndexCandidates.insert(pindex);
+        if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
+            pindexBestInvalid = pindex;
+        if (pindex->pprev)
+            pindex->BuildSkip();
+        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
+            pindexBestHeader = pindex;
+    }
+
+    // Load block file info
+    pblocktree->ReadLastBlockFile(nLastBlockFile);
+    vinfoBlockFile.resize(nLastBlockFile + 1);
+    LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
+    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
         pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
     }
     LogPrintf("%s: last block file info: %s\n", __func__, vinfoBlockFile[nLastBlockFile].ToString());
@@ -4130,6 +4909,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Finish a chainstate flush that was interrupted before it completed
+    if (!ReplayBlocks(chainparams, *pcoinsTip))
+        return false;
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -4340,6 +5123,9 @@ void UnloadBlockIndex()
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    pindexCoinsPrefetched = NULL;
+    mapCoinsPrefetchBlocks.clear();
+    nCoinsTipFlushes++;
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
@@ -4360,19 +5146,20 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     fHavePruned = false;
 }
 
 bool LoadBlockIndex()
 {
     // Load block index from databases
-    if (!fReindex && !LoadBlockIndexDB())
-        return false;
-    return true;
+    bool fOk = fReindex || LoadBlockIndexDB();
+    // The snapshot only matches the database until the index changes again,
+    // so it is used once; the next clean shutdown writes a new one.
+    boost::system::error_code ec;
+    boost::filesystem::remove(GetBlockIndexSnapshotPath(), ec);
+    return fOk;
 }
 
 bool InitBlockIndex(const CChainParams& chainparams) 
@@ -4416,113 +5203,138 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+/** Map of disk positions for blocks with unknown parent (only used for reindex) */
+static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
+/**
+ * Find the blocks in fileIn and pass each one with its hash to func. When dbp
+ * is set, its nPos is pointed at the block before the call. Stops at the end
+ * of the file or when func returns false. Blocks that fail to deserialize are
+ * logged and skipped.
+ */
+static void ScanExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp, const boost::function<bool (CBlock&, const uint256&)>& func)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+    CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
 
-    int nLoaded = 0;
-    try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(chainparams.MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            break;
+        }
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            if (dbp)
+                dbp->nPos = nBlockPos;
+            blkdat.SetLimit(nBlockPos + nSize);
+            blkdat.SetPos(nBlockPos);
+            CBlock block;
+            blkdat >> block;
+            nRewind = blkdat.GetPos();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
+            if (!func(block, block.GetHash()))
                 break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+    }
+}
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    LOCK(cs_main);
-                    CValidationState state;
-                    if (AcceptBlock(block, state, chainparams, NULL, true, dbp, NULL))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+/**
+ * Store a block read from an external file, at dbp if it is in one of our
+ * block files. Blocks with an unknown parent are remembered (for reindex) and
+ * stored once their parent has been. Returns false if storing the block
+ * failed and the import should stop.
+ */
+static bool AcceptExternalBlock(const CChainParams& chainparams, const CBlock& block, const uint256& hash, CDiskBlockPos *dbp, int& nLoaded)
+{
+    // detect out of order blocks, and store them for later
+    if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                block.hashPrevBlock.ToString());
+        if (dbp)
+            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+        return true;
+    }
 
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
-                    CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
-                    }
-                }
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        LOCK(cs_main);
+        CValidationState state;
+        if (AcceptBlock(block, state, chainparams, NULL, true, dbp, NULL))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
 
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            CValidationState dummy;
-                            if (AcceptBlock(block, dummy, chainparams, NULL, true, &it->second, NULL))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
-                    }
+    // Activate the genesis block so normal node progress can continue
+    if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+        CValidationState state;
+        if (!ActivateBestChain(state, chainparams)) {
+            return false;
+        }
+    }
+
+    NotifyHeaderTip();
+
+    // Recursively process earlier encountered successors of this block
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            CBlock blockChild;
+            if (ReadBlockFromDisk(blockChild, it->second, chainparams.GetConsensus()))
+            {
+                LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, blockChild.GetHash().ToString(),
+                        head.ToString());
+                LOCK(cs_main);
+                CValidationState dummy;
+                if (AcceptBlock(blockChild, dummy, chainparams, NULL, true, &it->second, NULL))
+                {
+                    nLoaded++;
+                    queue.push_back(blockChild.GetHash());
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+            NotifyHeaderTip();
         }
+    }
+    return true;
+}
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        ScanExternalBlockFile(chainparams, fileIn, dbp, boost::bind(&AcceptExternalBlock, boost::cref(chainparams), _1, _2, dbp, boost::ref(nLoaded)));
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
@@ -4531,6 +5343,202 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     return nLoaded > 0;
 }
 
+namespace {
+
+/** A block found by a reindex scan thread, waiting to be stored. */
+struct CReindexBlock
+{
+    std::shared_ptr<CBlock> pblock;
+    uint256 hash;
+    CDiskBlockPos pos;
+    size_t nSize;
+};
+
+/**
+ * Hands the blocks found in the block files by the reindex scan threads over
+ * to the import thread in file order. Each scan thread claims the next file,
+ * deserializes and hashes its blocks and runs the context-free checks on
+ * them, while the import thread stores the blocks of the earliest file.
+ * Blocks are therefore stored in the same order as by a single threaded
+ * reindex, and out of order blocks are handled the same way.
+ *
+ * Scan threads claim files at most nMaxFilesAhead past the one being stored,
+ * and the ones scanning later files wait while more than
+ * MAX_REINDEX_QUEUE_SIZE bytes of blocks are queued.
+ */
+class CReindexQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    //! Queued blocks per file, and whether the file has been scanned completely
+    std::map<int, std::pair<std::deque<CReindexBlock>, bool> > mapFiles;
+    //! Next file to be claimed by a scan thread
+    int nNextFile;
+    //! File whose blocks are being stored
+    int nCurrentFile;
+    //! First file that could not be opened; the reindex ends there
+    int nEndFile;
+    //! Total serialized size of the queued blocks
+    size_t nQueuedSize;
+    const int nMaxFilesAhead;
+    bool fStop;
+
+    bool Push(const CChainParams& chainparams, int nFile, CBlock& block, const uint256& hash, const CDiskBlockPos& pos)
+    {
+        CReindexBlock entry;
+        entry.pblock.reset(new CBlock(block.GetBlockHeader()));
+        entry.pblock->vtx.swap(block.vtx);
+        entry.hash = hash;
+        entry.pos = pos;
+        entry.nSize = ::GetSerializeSize(*entry.pblock, SER_DISK, CLIENT_VERSION);
+        // Sets fChecked on success, so AcceptBlock does not repeat the checks
+        CValidationState state;
+        CheckBlock(*entry.pblock, state, chainparams.GetConsensus());
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && nFile != nCurrentFile && nQueuedSize >= MAX_REINDEX_QUEUE_SIZE)
+            cond.wait(lock);
+        if (fStop || nFile >= nEndFile)
+            return false;
+        mapFiles[nFile].first.push_back(entry);
+        nQueuedSize += entry.nSize;
+        cond.notify_all();
+        return true;
+    }
+
+public:
+    CReindexQueue(int nMaxFilesAheadIn) : nNextFile(0), nCurrentFile(0), nEndFile(std::numeric_limits<int>::max()), nQueuedSize(0), nMaxFilesAhead(nMaxFilesAheadIn), fStop(false) {}
+
+    /** Scan block files until all have been claimed or Stop() is called. */
+    void ThreadScan(const CChainParams& chainparams)
+    {
+        while (true) {
+            int nFile;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNextFile < nEndFile && nNextFile - nCurrentFile >= nMaxFilesAhead)
+                    cond.wait(lock);
+                if (fStop || nNextFile >= nEndFile)
+                    return;
+                nFile = nNextFile++;
+            }
+
+            CDiskBlockPos pos(nFile, 0);
+            FILE *file = NULL;
+            if (boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+                file = OpenBlockFile(pos, true); // An error is logged in OpenBlockFile
+            if (file) {
+                try {
+                    ScanExternalBlockFile(chainparams, file, &pos, boost::bind(&CReindexQueue::Push, this, boost::cref(chainparams), nFile, _1, _2, boost::cref(pos)));
+                } catch (const std::runtime_error& e) {
+                    AbortNode(std::string("System error: ") + e.what());
+                }
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (file)
+                mapFiles[nFile].second = true;
+            else
+                nEndFile = std::min(nEndFile, nFile);
+            cond.notify_all();
+        }
+    }
+
+    /** Take the next block in file order. Returns false once all files have been stored. */
+    bool Pop(CReindexBlock& entry)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nCurrentFile < nEndFile) {
+            std::pair<std::deque<CReindexBlock>, bool>& file = mapFiles[nCurrentFile];
+            if (!file.first.empty()) {
+                entry = file.first.front();
+                file.first.pop_front();
+                nQueuedSize -= entry.nSize;
+                cond.notify_all();
+                return true;
+            }
+            if (file.second) {
+                mapFiles.erase(nCurrentFile);
+                nCurrentFile++;
+                cond.notify_all();
+                continue;
+            }
+            cond.wait(lock);
+        }
+        return false;
+    }
+
+    /** Make the scan threads return. */
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        cond.notify_all();
+    }
+};
+
+} // anon namespace
+
+void ReindexBlockFiles(const CChainParams& chainparams, int nThreads)
+{
+    if (nThreads <= 0) {
+        int nFile = 0;
+        while (true) {
+            CDiskBlockPos pos(nFile, 0);
+            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+                break; // No block files left to reindex
+            FILE *file = OpenBlockFile(pos, true);
+            if (!file)
+                break; // This error is logged in OpenBlockFile
+            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+            LoadExternalBlockFile(chainparams, file, &pos);
+            nFile++;
+        }
+        return;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int nLoaded = 0;
+    CReindexQueue queue(nThreads + 1);
+    boost::thread_group scanThreads;
+    for (int i = 0; i < nThreads; i++)
+        scanThreads.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "reindex", boost::function<void()>(boost::bind(&CReindexQueue::ThreadScan, &queue, boost::cref(chainparams)))));
+
+    try {
+        CReindexBlock entry;
+        int nFile = -1;
+        // A file in which storing a block failed; like LoadExternalBlockFile,
+        // give up on the rest of it and carry on with the next file.
+        int nFailedFile = -1;
+        while (queue.Pop(entry)) {
+            boost::this_thread::interruption_point();
+            if (entry.pos.nFile == nFailedFile)
+                continue;
+            if (entry.pos.nFile != nFile) {
+                nFile = entry.pos.nFile;
+                LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+            }
+            try {
+                if (!AcceptExternalBlock(chainparams, *entry.pblock, entry.hash, &entry.pos, nLoaded))
+                    nFailedFile = entry.pos.nFile;
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Error storing block %s - %s\n", __func__, entry.hash.ToString(), e.what());
+            }
+        }
+    } catch (...) {
+        queue.Stop();
+        scanThreads.interrupt_all();
+        scanThreads.join_all();
+        throw;
+    }
+    queue.Stop();
+    scanThreads.interrupt_all();
+    scanThreads.join_all();
+    LogPrintf("Loaded %i blocks from block files in %dms\n", nLoaded, GetTimeMillis() - nStart);
+}
+
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
 {
     if (!fCheckBlockIndex) {
@@ -4788,12 +5796,13 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
-            // Use pcoinsTip->HaveCoinsInCache as a quick approximation to exclude
+            // Use pcoinsTip->HaveCoinInCache as a quick approximation to exclude
             // requesting or processing some txs which have already been included in a block
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoinsInCache(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
     case MSG_WITNESS_BLOCK:
@@ -4803,14 +5812,262 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+namespace {
+/**
+ * Block payloads recently sent to peers, keyed by block hash and whether
+ * witness data is included. Blocks that many peers ask for at once, such as
+ * new blocks or the ones syncing peers walk through, are then read, serialized
+ * and hashed once, and every peer's send queue shares the same buffer.
+ */
+class CBlockServeCache
+{
+private:
+    typedef std::pair<uint256, bool> Key;
+    typedef std::list<std::pair<Key, CMessagePayloadRef> > EntryList;
+
+    //! Most recently used first.
+    EntryList entries;
+    std::map<Key, EntryList::iterator> mapEntries;
+    size_t nSize;
+
+public:
+    CBlockServeCache() : nSize(0) {}
+
+    CMessagePayloadRef Get(const uint256& hash, bool fWitness)
+    {
+        std::map<Key, EntryList::iterator>::iterator it = mapEntries.find(std::make_pair(hash, fWitness));
+        if (it == mapEntries.end())
+            return CMessagePayloadRef();
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->second;
+    }
+
+    void Put(const uint256& hash, bool fWitness, const CMessagePayloadRef& block, size_t nMaxSize)
+    {
+        Key key(hash, fWitness);
+        if (block->data.size() > nMaxSize || mapEntries.count(key))
+            return;
+        while (nSize + block->data.size() > nMaxSize) {
+            nSize -= entries.back().second->data.size();
+            mapEntries.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.push_front(std::make_pair(key, block));
+        mapEntries[key] = entries.begin();
+        nSize += block->data.size();
+    }
+};
+
+CCriticalSection cs_blockServeCache;
+CBlockServeCache blockServeCache; // Protected by cs_blockServeCache
+
+/** The last cmpctblock payloads made, without (0) and with (1) witness data. Protected by cs_blockServeCache */
+uint256 hashLastCmpctBlock;
+CMessagePayloadRef lastCmpctBlock[2];
+} // anon namespace
+
+namespace {
+/**
+ * Walks the transactions of a serialized block without decoding them, to
+ * compute their txids and find out whether any carries witness data. Returns
+ * false if the bytes are not exactly one well-formed block.
+ */
+class CRawBlockScanner
+{
+private:
+    const unsigned char* pbegin;
+    const unsigned char* pend;
+    const unsigned char* p;
+
+    bool Skip(uint64_t nBytes)
+    {
+        if (nBytes > (uint64_t)(pend - p))
+            return false;
+        p += nBytes;
+        return true;
+    }
+
+    bool ReadCompactSize(uint64_t& n)
+    {
+        if (p == pend)
+            return false;
+        unsigned char ch = *p++;
+        unsigned int nBytes = ch < 253 ? 0 : ch == 253 ? 2 : ch == 254 ? 4 : 8;
+        if (nBytes > (size_t)(pend - p))
+            return false;
+        n = nBytes ? 0 : ch;
+        for (unsigned int i = 0; i < nBytes; i++)
+            n |= (uint64_t)*p++ << (8 * i);
+        return true;
+    }
+
+    /** Skip a vector of items, each a fixed prefix followed by a script and a fixed suffix */
+    bool SkipItems(size_t nPrefix, size_t nSuffix)
+    {
+        uint64_t nItems, nScript;
+        if (!ReadCompactSize(nItems))
+            return false;
+        for (uint64_t i = 0; i < nItems; i++) {
+            if (!Skip(nPrefix) || !ReadCompactSize(nScript) || !Skip(nScript) || !Skip(nSuffix))
+                return false;
+        }
+        return true;
+    }
+
+public:
+    CRawBlockScanner(const unsigned char* pbeginIn, const unsigned char* pendIn) : pbegin(pbeginIn), pend(pendIn), p(pbeginIn) {}
+
+    bool Scan(std::vector<uint256>& vTxid, bool& fHasWitness)
+    {
+        uint64_t nTx;
+        fHasWitness = false;
+        if (!Skip(80) || !ReadCompactSize(nTx) || nTx > (uint64_t)(pend - p))
+            return false;
+        vTxid.resize(nTx);
+        for (uint64_t n = 0; n < nTx; n++) {
+            // The txid covers the transaction without the witness marker,
+            // flag and witness data.
+            CHash256 hasher;
+            const unsigned char* pstart = p;
+            if (!Skip(4))
+                return false;
+            bool fWitnessTx = p + 1 < pend && p[0] == 0 && p[1] == 1;
+            if (fWitnessTx) {
+                hasher.Write(pstart, 4);
+                p += 2;
+                pstart = p;
+            }
+            uint64_t nIn = 0;
+            const unsigned char* pvin = p;
+            if (!ReadCompactSize(nIn))
+                return false;
+            p = pvin;
+            if (!SkipItems(36, 4) || !SkipItems(8, 0))
+                return false;
+            if (fWitnessTx) {
+                hasher.Write(pstart, p - pstart);
+                for (uint64_t i = 0; i < nIn; i++) {
+                    uint64_t nStack, nItem;
+                    if (!ReadCompactSize(nStack))
+                        return false;
+                    for (uint64_t j = 0; j < nStack; j++) {
+                        if (!ReadCompactSize(nItem) || !Skip(nItem))
+                            return false;
+                    }
+                }
+                pstart = p;
+                fHasWitness = true;
+            }
+            if (!Skip(4))
+                return false;
+            hasher.Write(pstart, p - pstart);
+            hasher.Finalize(vTxid[n].begin());
+        }
+        return p == pend;
+    }
+};
+} // anon namespace
+
+/**
+ * Return the payload of a block message, with or without witness data, from
+ * blockServeCache or from disk. The bytes stored on disk are sent as they
+ * are, unless witness data has to be removed; they are checked against the
+ * header hash and merkle root first. Doesn't need cs_main: a block pruned in
+ * the meantime just fails to load.
+ */
+static CMessagePayloadRef GetServedBlock(const uint256& hash, const CDiskBlockPos& pos, bool fWitness)
+{
+    {
+        LOCK(cs_blockServeCache);
+        CMessagePayloadRef pcached = blockServeCache.Get(hash, fWitness);
+        if (pcached)
+            return pcached;
+    }
+
+    // Read straight into the buffer the payload takes over, so the block
+    // is not copied again on its way into blockServeCache.
+    CSerializeData vBlock;
+    if (!ReadRawBlockFromDisk(vBlock, pos))
+        return CMessagePayloadRef();
+    const unsigned char* pbegin = (const unsigned char*)&vBlock[0];
+    if (vBlock.size() < 80 || Hash(pbegin, pbegin + 80) != hash) {
+        error("%s: block %s on disk doesn't match its header", __func__, hash.ToString());
+        return CMessagePayloadRef();
+    }
+    std::vector<uint256> vTxid;
+    bool fHasWitness;
+    uint256 hashMerkleRoot;
+    memcpy(hashMerkleRoot.begin(), pbegin + 36, 32);
+    if (!CRawBlockScanner(pbegin, pbegin + vBlock.size()).Scan(vTxid, fHasWitness) ||
+        vTxid.empty() || ComputeMerkleRoot(vTxid) != hashMerkleRoot) {
+        error("%s: block %s on disk doesn't match its merkle root", __func__, hash.ToString());
+        return CMessagePayloadRef();
+    }
+
+    CMessagePayloadRef payload;
+    if (!fWitness && fHasWitness) {
+        CBlock block;
+        try {
+            CMemoryReader reader(SER_NETWORK, PROTOCOL_VERSION, &vBlock[0], &vBlock[0] + vBlock.size());
+            reader >> block;
+        }
+        catch (const std::exception& e) {
+            error("%s: Deserialize error - %s in block %s", __func__, e.what(), hash.ToString());
+            return CMessagePayloadRef();
+        }
+        payload = MakeMessagePayload(PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS, block);
+    } else {
+        payload = std::make_shared<const CMessagePayload>(vBlock);
+    }
+
+    LOCK(cs_blockServeCache);
+    blockServeCache.Put(hash, fWitness, payload, nBlockServeCacheSize);
+    // Without witness data both kinds of request get the same bytes.
+    if (!fHasWitness)
+        blockServeCache.Put(hash, !fWitness, payload, nBlockServeCacheSize);
+    return payload;
+}
+
+/**
+ * Return the payload of a cmpctblock message for a block. A new block is
+ * announced to all high bandwidth peers at about the same time, so the last
+ * one is kept and only built once.
+ */
+static CMessagePayloadRef GetCmpctBlockPayload(const uint256& hash, const CDiskBlockPos& pos, bool fWitness, const Consensus::Params& consensusParams)
+{
+    {
+        LOCK(cs_blockServeCache);
+        if (hash == hashLastCmpctBlock && lastCmpctBlock[fWitness])
+            return lastCmpctBlock[fWitness];
+    }
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pos, consensusParams) || block.GetHash() != hash)
+        return CMessagePayloadRef();
+    CBlockHeaderAndShortTxIDs cmpctblock(block, fWitness);
+    CMessagePayloadRef payload = MakeMessagePayload(PROTOCOL_VERSION | (fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS), cmpctblock);
+
+    LOCK(cs_blockServeCache);
+    if (hash != hashLastCmpctBlock) {
+        hashLastCmpctBlock = hash;
+        lastCmpctBlock[0].reset();
+        lastCmpctBlock[1].reset();
+    }
+    lastCmpctBlock[fWitness] = payload;
+    return payload;
+}
+
+/**
+ * Answer the queued getdata requests of a peer. cs_main is only held to
+ * decide what to send; blocks are loaded and serialized without it, so
+ * several message handler threads can serve blocks at the same time.
+ */
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4824,95 +6081,127 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
             {
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CDiskBlockPos pos;
+                bool fPeerWantsWitness = false;
+                bool fCmpctBlock = false;
+                uint256 hashTip;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
-                }
-                // disconnect node in case we have reached the outbound limit for serving historical blocks
-                // never disconnect whitelisted nodes
-                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
-                if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
-                {
-                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    // disconnect node in case we have reached the outbound limit for serving historical blocks
+                    // never disconnect whitelisted nodes
+                    static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                    if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
 
-                    //disconnect node
-                    pfrom->fDisconnect = true;
-                    send = false;
+                        //disconnect node
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    send = send && (mi->second->nStatus & BLOCK_HAVE_DATA);
+                    if (send) {
+                        pos = mi->second->GetBlockPos();
+                        fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+                        fCmpctBlock = inv.type == MSG_CMPCT_BLOCK && CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                        if (inv.hash == pfrom->hashContinue)
+                            hashTip = chainActive.Tip()->GetBlockHash();
+                    }
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_FILTERED_BLOCK)
+                    if (inv.type != MSG_FILTERED_BLOCK && !fCmpctBlock)
+                    {
+                        // Send the serialized block without decoding it. If a peer is asking
+                        // for an old block as a compact block, we're almost guaranteed
+                        // they wont have a useful mempool to match against, and we don't
+                        // feel like constructing the object for them, so instead we respond
+                        // with the full, non-compact block.
+                        bool fWitness = inv.type == MSG_WITNESS_BLOCK || (inv.type == MSG_CMPCT_BLOCK && fPeerWantsWitness);
+                        CMessagePayloadRef pblock = GetServedBlock(inv.hash, pos, fWitness);
+                        if (pblock) {
+                            pfrom->PushMessagePayload(NetMsgType::BLOCK, pblock);
+                        } else {
+                            send = false;
+                        }
+                    }
+                    else if (fCmpctBlock)
+                    {
+                        CMessagePayloadRef pcmpctblock = GetCmpctBlockPayload(inv.hash, pos, fPeerWantsWitness, consensusParams);
+                        if (pcmpctblock)
+                            pfrom->PushMessagePayload(NetMsgType::CMPCTBLOCK, pcmpctblock);
+                        else
+                            send = false;
+                    }
+                    else
                     {
-                        bool send = false;
-                        CMerkleBlock merkleBlock;
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, pos, consensusParams) || block.GetHash() != inv.hash)
                         {
-                            LOCK(pfrom->cs_filter);
-                            if (pfrom->pfilter) {
-                                send = true;
-                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
-                            }
+                            send = false;
                         }
-                        if (send) {
-                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+                        else
+                        {
+                            bool send = false;
+                            CMerkleBlock merkleBlock;
+                            {
+                                LOCK(pfrom->cs_filter);
+                                if (pfrom->pfilter) {
+                                    send = true;
+                                    merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
+                                }
+                            }
+                            if (send) {
+                                pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                                    pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+                            }
+                            // else
+                                // no response
                         }
-                        // else
-                            // no response
                     }
-                    else if (inv.type == MSG_CMPCT_BLOCK)
-                    {
-                        // If a peer is asking for old blocks, we're almost guaranteed
-                        // they wont have a useful mempool to match against a compact block,
-                        // and we don't feel like constructing the object for them, so
-                        // instead we respond with the full, non-compact block.
-                        bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
-                        if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
-                            CBlockHeaderAndShortTxIDs cmpctblock(block, fPeerWantsWitness);
-                            pfrom->PushMessageWithFlag(fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
-                        } else
-                            pfrom->PushMessageWithFlag(fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+
+                    // The block may have been pruned since it was looked up
+                    if (!send) {
+                        LogPrintf("%s: cannot load block %s for peer=%d\n", __func__, inv.hash.ToString(), pfrom->GetId());
+                        vNotFound.push_back(inv);
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    if (send && !hashTip.IsNull())
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         pfrom->PushMessage(NetMsgType::INV, vInv);
                         pfrom->hashContinue.SetNull();
                     }
@@ -4922,9 +6211,15 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             {
                 // Send stream from relay memory
                 bool push = false;
-                auto mi = mapRelay.find(inv.hash);
-                if (mi != mapRelay.end()) {
-                    pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *mi->second);
+                std::shared_ptr<const CTransaction> ptx;
+                {
+                    LOCK(cs_main);
+                    auto mi = mapRelay.find(inv.hash);
+                    if (mi != mapRelay.end())
+                        ptx = mi->second;
+                }
+                if (ptx) {
+                    pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *ptx);
                     push = true;
                 } else if (pfrom->timeLastMempoolReq) {
                     auto txinfo = mempool.info(inv.hash);
@@ -4970,6 +6265,61 @@ uint32_t GetFetchFlags(CNode* pfrom, CBlockIndex* pprev, const Consensus::Params
     return nFetchFlags;
 }
 
+/** Hand a full block received from pfrom to validation and punish the peer if it is invalid. */
+static void ProcessBlockFromPeer(const CChainParams& chainparams, CNode* pfrom, const CBlock& block, bool fForceProcessing)
+{
+    CValidationState state;
+    ProcessNewBlock(state, chainparams, pfrom, &block, fForceProcessing, NULL, true);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
+        pfrom->PushMessage(NetMsgType::REJECT, std::string(NetMsgType::BLOCK), (unsigned char)state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+/**
+ * Run on the block check threads: do the context-free checks (proof of work,
+ * merkle root, CheckTransaction, size and sigop limits) without holding
+ * cs_main, so blocks from several peers are checked in parallel and in
+ * whatever order they arrive. On success the result is cached in
+ * CBlock::fChecked, which AcceptBlock carries over to CBlockIndex::fChecked
+ * so ConnectBlock does not repeat the checks. The block is then handed back
+ * to the message handler of its peer, which connects it in
+ * ProcessCheckedBlocks. Takes over a reference to pfrom.
+ */
+static void CheckBlockForPeer(const CChainParams& chainparams, CNode* pfrom, std::shared_ptr<CBlock> pblock, bool fForceProcessing)
+{
+    CValidationState state;
+    CheckBlock(*pblock, state, chainparams.GetConsensus());
+    {
+        LOCK(cs_checkedBlocks);
+        mapCheckedBlocks[pfrom->GetId()].push_back(std::make_pair(pblock, fForceProcessing));
+    }
+    pfrom->Release();
+    WakeMessageHandler();
+}
+
+/** Connect the blocks from pfrom that the block check threads are done with. */
+static void ProcessCheckedBlocks(const CChainParams& chainparams, CNode* pfrom)
+{
+    std::vector<std::pair<std::shared_ptr<CBlock>, bool> > vBlocks;
+    {
+        LOCK(cs_checkedBlocks);
+        map<NodeId, vector<pair<std::shared_ptr<CBlock>, bool> > >::iterator it = mapCheckedBlocks.find(pfrom->GetId());
+        if (it == mapCheckedBlocks.end())
+            return;
+        vBlocks.swap(it->second);
+        mapCheckedBlocks.erase(it);
+    }
+    for (size_t i = 0; i < vBlocks.size(); i++)
+        ProcessBlockFromPeer(chainparams, pfrom, *vBlocks[i].first, vBlocks[i].second);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -6091,29 +7441,30 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
-        CBlock block;
-        vRecv >> block;
+        std::shared_ptr<CBlock> pblock(new CBlock());
+        vRecv >> *pblock;
 
-        LogPrint("net", "received block %s peer=%d\n", block.GetHash().ToString(), pfrom->id);
+        LogPrint("net", "received block %s peer=%d\n", pblock->GetHash().ToString(), pfrom->id);
 
-        CValidationState state;
         // Process all blocks from whitelisted peers, even if not requested,
         // unless we're still syncing with the network.
         // Such an unrequested block may still be processed, subject to the
         // conditions in AcceptBlock().
         bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
-        ProcessNewBlock(state, chainparams, pfrom, &block, forceProcessing, NULL, true);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
-            pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
-            if (nDoS > 0) {
+        boost::chrono::system_clock::time_point first, last;
+        if (nBlockCheckThreads > 0 && IsInitialBlockDownload() && blockcheckpool.getQueueInfo(first, last) < MAX_BLOCKCHECK_QUEUE) {
+            // Take the block out of flight right away, so its peer is not
+            // considered to be stalling the download while the block waits
+            // for a check thread.
+            {
                 LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+                forceProcessing |= MarkBlockAsReceived(pblock->GetHash());
             }
+            blockcheckpool.schedule(boost::bind(&CheckBlockForPeer, boost::cref(chainparams), pfrom->AddRef(), pblock, forceProcessing),
+                                    boost::chrono::system_clock::now());
+        } else {
+            ProcessBlockFromPeer(chainparams, pfrom, *pblock, forceProcessing);
         }
-
     }
 
 
@@ -6137,7 +7488,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -6368,6 +7722,8 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    ProcessCheckedBlocks(chainparams, pfrom);
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom, chainparams.GetConsensus());
 
@@ -6416,8 +7772,8 @@ bool ProcessMessages(CNode* pfrom)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
+        const uint256& hash = msg.GetMessageHash();
+        unsigned int nChecksum = ReadLE32(hash.begin());
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
@@ -6548,27 +7904,28 @@ bool SendMessages(CNode* pto)
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_addrToSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage(NetMsgType::ADDR, vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+                // we only send the big addr message once
+                if (pto->vAddrToSend.capacity() > 40)
+                    pto->vAddrToSend.shrink_to_fit();
+            }
+            // receiver rejects addr messages larger than 1000
+            for (size_t nStart = 0; nStart < vAddr.size(); nStart += 1000)
+            {
+                vector<CAddress> vChunk(vAddr.begin() + nStart, vAddr.begin() + std::min(vAddr.size(), nStart + 1000));
+                pto->PushMessage(NetMsgType::ADDR, vChunk);
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage(NetMsgType::ADDR, vAddr);
-            // we only send the big addr message once
-            if (pto->vAddrToSend.capacity() > 40)
-                pto->vAddrToSend.shrink_to_fit();
         }
 
         CNodeState &state = *State(pto->GetId());
@@ -6696,11 +8053,10 @@ bool SendMessages(CNode* pto)
                     // probably means we're doing an initial-ish-sync or they're slow
                     LogPrint("net", "%s sending header-and-ids %s to peer %d\n", __func__,
                             vHeaders.front().GetHash().ToString(), pto->id);
-                    //TODO: Shouldn't need to reload block from disk, but requires refactor
-                    CBlock block;
-                    assert(ReadBlockFromDisk(block, pBestIndex, consensusParams));
-                    CBlockHeaderAndShortTxIDs cmpctblock(block, state.fWantsCmpctWitness);
-                    pto->PushMessageWithFlag(state.fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
+                    CMessagePayloadRef pcmpctblock = GetCmpctBlockPayload(pBestIndex->GetBlockHash(), pBestIndex->GetBlockPos(), state.fWantsCmpctWitness, consensusParams);
+                    if (!pcmpctblock)
+                        assert(!"cannot load block from disk");
+                    pto->PushMessagePayload(NetMsgType::CMPCTBLOCK, pcmpctblock);
                     state.pindexBestHeaderSent = pBestIndex;
                 } else if (state.fPreferHeaders) {
                     if (vHeaders.size() > 1) {
@@ -6994,10 +8350,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
@@ -33,6 +33,8 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewBackgroundFlush;
+class CDataStream;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
@@ -82,6 +84,18 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -blockcheckthreads default, threads running context-free checks of blocks received during IBD (0 = check on the message handler thread) */
+static const int DEFAULT_BLOCKCHECK_THREADS = 2;
+/** Maximum number of threads running context-free checks of received blocks */
+static const int MAX_BLOCKCHECK_THREADS = 8;
+/** Maximum number of received blocks waiting for the block check threads; beyond that the message handler checks them itself */
+static const unsigned int MAX_BLOCKCHECK_QUEUE = 64;
+/** -reindexthreads default, threads scanning block files during -reindex (0 = scan them on the import thread) */
+static const int DEFAULT_REINDEX_THREADS = 4;
+/** Maximum number of threads scanning block files during -reindex */
+static const int MAX_REINDEX_THREADS = 16;
+/** Serialized size of the blocks found by the reindex scan threads that may wait to be stored, beyond those of the file being stored */
+static const size_t MAX_REINDEX_QUEUE_SIZE = 256 * 1024 * 1024;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -94,6 +108,12 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
 static const int MAX_CMPCTBLOCK_DEPTH = 5;
 /** Maximum depth of blocks we're willing to respond to GETBLOCKTXN requests for. */
 static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Default for -blockservecache, the size in MiB of the cache of serialized blocks sent to peers */
+static const unsigned int DEFAULT_BLOCK_SERVE_CACHE = 32;
+/** Default for -mmapblocks, reading finalized block and undo files through memory mappings */
+static const bool DEFAULT_MMAP_BLOCKS = false;
+/** Maximum number of block and undo files kept mapped with -mmapblocks */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = 256;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -131,6 +151,8 @@ static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
 /** Default for -permitbaremultisig */
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
+/** Default for -connectpipeline, overlapping input lookups with script verification in ConnectBlock */
+static const bool DEFAULT_CONNECT_PIPELINE = true;
 static const bool DEFAULT_TXINDEX = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
@@ -167,11 +189,15 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nBlockCheckThreads;
+extern size_t nBlockServeCacheSize;
+extern bool fMmapBlocks;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
+extern bool fConnectPipeline;
 extern size_t nCoinCacheUsage;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
@@ -181,6 +207,9 @@ extern CAmount maxTxFee;
 extern int64_t nMaxTipAge;
 extern bool fEnableReplacement;
 
+/** Block hash whose ancestors we will assume to have valid scripts without checking them. */
+extern uint256 hashAssumeValid;
+
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex *pindexBestHeader;
 
@@ -199,6 +228,8 @@ static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
 
 static const signed int DEFAULT_CHECKBLOCKS = 6;
 static const unsigned int DEFAULT_CHECKLEVEL = 3;
+/** Default for -blockindexsnapshot */
+static const bool DEFAULT_BLOCK_INDEX_SNAPSHOT = true;
 
 // Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat)
 // At 1MB per block, 288 blocks = 288MB.
@@ -238,6 +269,8 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Rebuild the block index from the blk*.dat files, scanning them on nThreads threads (0 = on the calling thread) */
+void ReindexBlockFiles(const CChainParams& chainparams, int nThreads);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
@@ -254,6 +287,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the context-free block checking thread */
+void ThreadBlockCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -300,6 +335,14 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/**
+ * Write the whole block index to a snapshot file that the next start loads
+ * instead of reading the block tree database. Only done when the index is
+ * completely flushed; returns false otherwise.
+ */
+bool WriteBlockIndexSnapshot();
+/** Whether the block index was loaded from the snapshot rather than the block tree database */
+bool IsBlockIndexFromSnapshot();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
@@ -351,9 +394,15 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
  * instead of being performed inline.
+ * Transactions whose scripts already passed with exactly these flags are found in the script
+ * execution cache and not interpreted again; cacheFullScriptStore adds a successful result to
+ * that cache (only when the checks are performed inline). Requires cs_main.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
+
+/** Size the script execution cache from -maxsigcachesize. Must be called once before CheckInputs. */
+void InitScriptExecutionCache();
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -418,8 +467,8 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
@@ -441,6 +490,9 @@ public:
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+/** Read the serialized bytes of the block at pos, as written by WriteBlockToDisk. */
+bool ReadRawBlockFromDisk(std::vector<char>& block, const CDiskBlockPos& pos);
+bool ReadRawBlockFromDisk(CSerializeData& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 
@@ -506,6 +558,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the view writing pcoinsTip flushes to the chainstate database, if any */
+extern CCoinsViewBackgroundFlush *pcoinsFlush;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -0,0 +1,76 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::CMappedFile(const boost::filesystem::path& path) : pdata(NULL), nSize(0)
+{
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            pdata = (const unsigned char*)p;
+            nSize = st.st_size;
+        }
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+#endif
+}
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    if (pdata)
+        munmap((void*)pdata, nSize);
+#endif
+}
+
+std::shared_ptr<const CMappedFile> CMappedFileCache::Get(const boost::filesystem::path& path, size_t nMinSize)
+{
+    LOCK(cs);
+    std::map<boost::filesystem::path, EntryList::iterator>::iterator it = mapEntries.find(path);
+    if (it != mapEntries.end()) {
+        entries.splice(entries.begin(), entries, it->second);
+        if (it->second->second->size() >= nMinSize)
+            return it->second->second;
+        // The file grew; map it again. Readers of the old mapping keep it alive.
+        entries.erase(it->second);
+        mapEntries.erase(it);
+    }
+
+    std::shared_ptr<const CMappedFile> pfile = std::make_shared<const CMappedFile>(path);
+    if (pfile->IsNull())
+        return std::shared_ptr<const CMappedFile>();
+    while (!entries.empty() && entries.size() >= nMaxFiles) {
+        mapEntries.erase(entries.back().first);
+        entries.pop_back();
+    }
+    entries.push_front(std::make_pair(path, pfile));
+    mapEntries[path] = entries.begin();
+    if (pfile->size() < nMinSize)
+        return std::shared_ptr<const CMappedFile>();
+    return pfile;
+}
+
+void CMappedFileCache::Erase(const boost::filesystem::path& path)
+{
+    LOCK(cs);
+    std::map<boost::filesystem::path, EntryList::iterator>::iterator it = mapEntries.find(path);
+    if (it != mapEntries.end()) {
+        entries.erase(it->second);
+        mapEntries.erase(it);
+    }
+}
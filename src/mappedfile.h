@@ -0,0 +1,72 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <stddef.h>
+
+#include <boost/filesystem/path.hpp>
+
+/**
+ * A read-only memory mapping of a whole file. Mapping fails (IsNull) for
+ * empty files, and always on Windows.
+ */
+class CMappedFile
+{
+private:
+    // Disallow copies
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+    const unsigned char* pdata;
+    size_t nSize;
+
+public:
+    explicit CMappedFile(const boost::filesystem::path& path);
+    ~CMappedFile();
+
+    bool IsNull() const { return pdata == NULL; }
+    const unsigned char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+/**
+ * Mappings of files that are only appended to, such as finalized block and
+ * undo files. Reading through them lets the page cache serve repeated reads
+ * without copying the data into stdio buffers first. At most nMaxFiles files
+ * stay mapped; the least recently used one is unmapped when another file is
+ * needed.
+ */
+class CMappedFileCache
+{
+private:
+    typedef std::list<std::pair<boost::filesystem::path, std::shared_ptr<const CMappedFile> > > EntryList;
+
+    CCriticalSection cs;
+    //! Most recently used first.
+    EntryList entries;
+    std::map<boost::filesystem::path, EntryList::iterator> mapEntries;
+    const size_t nMaxFiles;
+
+public:
+    explicit CMappedFileCache(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn) {}
+
+    /**
+     * Return a mapping of the file at path that is at least nMinSize bytes
+     * long, mapping the file again if it grew since it was mapped. Returns
+     * NULL if the file can't be mapped or is too short.
+     */
+    std::shared_ptr<const CMappedFile> Get(const boost::filesystem::path& path, size_t nMinSize);
+
+    /** Forget the mapping of a file, for example as it is removed. */
+    void Erase(const boost::filesystem::path& path);
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
@@ -27,6 +27,11 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -45,6 +50,30 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+// Most queued buffers handed to one sendmsg call
+#define MAX_SEND_BUFFERS 64
+
+// Smallest receive buffer that is pooled for reuse, 64 KiB
+#define MIN_POOLED_RECV_BUFFER (1 << 16)
+// Number of pooled receive buffer sizes, doubling from the smallest up to 4 MiB
+#define RECV_BUFFER_CLASSES 7
+// Most bytes kept in pooled receive buffers
+#define MAX_POOLED_RECV_BUFFERS (16 << 20)
+
+static_assert(((size_t)MIN_POOLED_RECV_BUFFER << (RECV_BUFFER_CLASSES - 1)) >= MAX_PROTOCOL_MESSAGE_LENGTH,
+              "the largest pooled receive buffer must fit the largest message");
+
+#ifdef USE_EPOLL
+// Most readiness events taken from one epoll_wait call
+#define MAX_SOCKET_EVENTS 64
+// Most 64 KiB reads from one socket before the other ready sockets get a turn
+#define MAX_SOCKET_RECV_CHUNKS 4
+// Milliseconds before retrying sockets whose buffers were locked by another thread
+#define SOCKET_RETRY_INTERVAL 10
+// Milliseconds between disconnecting nodes and checking them for inactivity
+#define SOCKET_HOUSEKEEPING_INTERVAL 100
+#endif
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -91,8 +120,15 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+#ifdef USE_EPOLL
+// epoll instance of the socket handler thread, or -1 if it uses select()
+static int hEpoll = -1;
+// eventfd registered with hEpoll to wake the socket handler thread
+static int hEpollWake = -1;
+#endif
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+int nMaxConnectionsSelect = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
@@ -116,6 +152,93 @@ boost::condition_variable messageHandlerCondition;
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+// Whether the socket handler thread can wait on hSocket
+static bool IsServiceableSocket(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+        return true;
+#endif
+    return IsSelectableSocket(hSocket);
+}
+
+// requires LOCK(cs_vNodes)
+// Let the socket handler thread wait on a node just added to vNodes.
+static void AddSocketEvents(CNode *pnode)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
+void WakeMessageHandler()
+{
+    messageHandlerCondition.notify_one();
+}
+
+// Wake the socket handler thread, to resume reading from nodes whose receive
+// buffer had been full.
+static void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hEpollWake == -1)
+        return;
+    uint64_t nCount = 1;
+    if (write(hEpollWake, &nCount, sizeof(nCount)) < 0) {
+        // Only fails if the counter would overflow, so a wakeup is pending anyway
+    }
+#endif
+}
+
+#ifdef USE_EPOLL
+// Set up the epoll instance for the socket handler thread. It falls back to
+// select() if this fails.
+static void InitSocketEvents()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    hEpollWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    bool fOk = hEpoll != -1 && hEpollWake != -1;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &hEpollWake;
+    fOk = fOk && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hEpollWake, &event) == 0;
+    BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket) {
+        // Level-triggered, one connection is accepted per event
+        event.events = EPOLLIN;
+        event.data.ptr = &hListenSocket;
+        fOk = fOk && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) == 0;
+    }
+
+    if (!fOk) {
+        LogPrintf("Failed to set up epoll, using select(): %s\n", NetworkErrorString(errno));
+        if (hEpoll != -1)
+            close(hEpoll);
+        if (hEpollWake != -1)
+            close(hEpollWake);
+        hEpoll = hEpollWake = -1;
+        // select() cannot wait on descriptors from FD_SETSIZE up
+        if (nMaxConnections > nMaxConnectionsSelect) {
+            LogPrintf("Reducing -maxconnections from %d to %d for select()\n", nMaxConnections, nMaxConnectionsSelect);
+            nMaxConnections = nMaxConnectionsSelect;
+        }
+        return;
+    }
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        AddSocketEvents(pnode);
+}
+#endif
+
 void AddOneShot(const std::string& strDest)
 {
     LOCK(cs_vOneShots);
@@ -408,7 +531,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsServiceableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -443,6 +566,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            AddSocketEvents(pnode);
         }
 
         pnode->nServicesExpected = ServiceFlags(addrConnect.nServices & nRelevantServices);
@@ -721,6 +845,70 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
+namespace {
+/**
+ * Receive buffers of large messages, kept for the next ones once a message
+ * has been processed. Their capacities are powers of two, so that any buffer
+ * fits all later messages of its size class.
+ */
+class CRecvBufferPool
+{
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree[RECV_BUFFER_CLASSES];
+    size_t nPooledSize;
+
+    static int GetClass(size_t nSize)
+    {
+        int nClass = 0;
+        while (((size_t)MIN_POOLED_RECV_BUFFER << nClass) < nSize)
+            nClass++;
+        return nClass;
+    }
+
+public:
+    CRecvBufferPool() : nPooledSize(0) {}
+
+    /** Make data an empty buffer with room for at least nSize bytes */
+    void Get(size_t nSize, CSerializeData& data)
+    {
+        int nClass = GetClass(nSize);
+        assert(nClass < RECV_BUFFER_CLASSES);
+        {
+            LOCK(cs);
+            if (!vFree[nClass].empty()) {
+                data.swap(vFree[nClass].back());
+                vFree[nClass].pop_back();
+                nPooledSize -= data.capacity();
+                data.clear();
+                return;
+            }
+        }
+        data.clear();
+        data.reserve((size_t)MIN_POOLED_RECV_BUFFER << nClass);
+    }
+
+    /** Take the buffer of data for reuse, if it came from Get and there is room */
+    void Put(CSerializeData& data)
+    {
+        size_t nCapacity = data.capacity();
+        if (nCapacity < MIN_POOLED_RECV_BUFFER)
+            return;
+        int nClass = GetClass(nCapacity);
+        if (nClass >= RECV_BUFFER_CLASSES || ((size_t)MIN_POOLED_RECV_BUFFER << nClass) != nCapacity)
+            return;
+        LOCK(cs);
+        if (nPooledSize + nCapacity > MAX_POOLED_RECV_BUFFERS)
+            return;
+        vFree[nClass].push_back(CSerializeData());
+        vFree[nClass].back().swap(data);
+        nPooledSize += nCapacity;
+    }
+};
+
+CRecvBufferPool recvBufferPool;
+} // anon namespace
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -807,15 +995,43 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024);
+        if (nSize > vRecv.capacity() && nSize >= MIN_POOLED_RECV_BUFFER) {
+            // Move to a pooled buffer at least twice as large, so a large
+            // message is only copied a few times while it arrives.
+            CSerializeData data;
+            recvBufferPool.Get(std::min((size_t)hdr.nMessageSize, std::max((size_t)nSize, 2 * vRecv.capacity())), data);
+            data.insert(data.end(), vRecv.begin(), vRecv.begin() + nDataPos);
+            vRecv.Swap(data);
+            recvBufferPool.Put(data);
+        }
+        vRecv.resize(nSize);
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
+    hasher.Write((const unsigned char*)pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+const uint256& CNetMessage::GetMessageHash() const
+{
+    assert(complete());
+    if (!fHashed) {
+        hasher.Finalize(data_hash.begin());
+        fHashed = true;
+    }
+    return data_hash;
+}
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData data;
+    vRecv.Swap(data);
+    recvBufferPool.Put(data);
+}
+
 
 
 
@@ -827,23 +1043,51 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
-
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+    while (!pnode->vSendMsg.empty()) {
+        // Hand as many queued buffers as possible to the kernel at once
+        size_t nToSend = 0;
+#ifdef WIN32
+        const CSerializeData& data = *pnode->vSendMsg.front();
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        nToSend = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[MAX_SEND_BUFFERS];
+        int nBuffers = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<std::shared_ptr<const CSerializeData> >::const_iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; it++) {
+            const CSerializeData& data = **it;
+            assert(data.size() > nOffset);
+            iov[nBuffers].iov_base = (void*)&data[nOffset];
+            iov[nBuffers].iov_len = data.size() - nOffset;
+            nToSend += iov[nBuffers].iov_len;
+            nBuffers++;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nBuffers;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
+                pnode->nSendSize -= pnode->vSendMsg.front()->size();
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
+                pnode->vSendMsg.pop_front();
+            }
+            if ((size_t)nBytes < nToSend) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -861,11 +1105,10 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static std::list<CNode*> vNodesDisconnected;
@@ -1043,7 +1286,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsServiceableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1085,76 +1328,358 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+        AddSocketEvents(pnode);
     }
 }
 
-void ThreadSocketHandler()
+// requires LOCK(cs_vRecvMsg)
+// Whether a complete message is waiting for the message handler and the
+// receive buffer is over -maxreceivebuffer. No more data is read from the
+// socket then, so the peer is throttled by TCP flow control.
+static bool IsReceiveBufferFull(CNode *pnode)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+           pnode->GetTotalRecvSize() > ReceiveFloodSize();
+}
+
+// requires LOCK(cs_vRecvMsg)
+// Read once from the node's socket. Returns the result of recv().
+static int SocketRecvData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
     {
-        //
-        // Disconnect nodes
-        //
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            std::vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return nBytes;
+}
+
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        std::vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static void InactivityCheck(CNode *pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+// requires LOCK(cs_vNodes)
+// Drop the nodes being disconnected from a set of nodes the socket handler
+// holds a reference to.
+static void ReleaseDisconnected(std::set<CNode*>& setNodes)
+{
+    std::set<CNode*>::iterator it = setNodes.begin();
+    while (it != setNodes.end()) {
+        if ((*it)->fDisconnect || (*it)->hSocket == INVALID_SOCKET) {
+            (*it)->Release();
+            it = setNodes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/**
+ * Socket handler loop on top of epoll. Node sockets are registered once, for
+ * both directions and edge-triggered, when they are added to vNodes, so there
+ * is nothing to rebuild per wakeup and interest never has to be changed: a
+ * readable edge is followed by reading until the socket would block, and a
+ * writable edge only arrives once a send could not complete, which is exactly
+ * when the remaining data has to be sent from here.
+ *
+ * Nodes that still need servicing after a pass, because another thread held
+ * their buffer lock or to give other sockets a turn, stay in setReady. Nodes
+ * whose receive buffer is full move to setPaused until the message handler
+ * has made room and wakes this thread through hEpollWake. Both sets hold a
+ * reference to their nodes. Disconnecting and the inactivity checks run every
+ * SOCKET_HOUSEKEEPING_INTERVAL milliseconds.
+ */
+static void SocketEventsLoop()
+{
+    std::set<CNode*> setReady;
+    std::set<CNode*> setPaused;
+    std::vector<CNode*> vEventNodes;
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    unsigned int nPrevNodeCount = 0;
+    int64_t nNextHousekeeping = 0;
+    bool fMoreData = false;
+
+    while (true)
+    {
+        int64_t nNow = GetTimeMillis();
+        if (nNow >= nNextHousekeeping)
+        {
+            {
+                // Let go of nodes being disconnected, so they can be deleted
+                LOCK(cs_vNodes);
+                ReleaseDisconnected(setReady);
+                ReleaseDisconnected(setPaused);
+            }
+            DisconnectNodes(nPrevNodeCount);
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    InactivityCheck(pnode);
+            }
+            nNextHousekeeping = nNow + SOCKET_HOUSEKEEPING_INTERVAL;
+        }
+
+        int nTimeout = nNextHousekeeping - nNow;
+        if (fMoreData)
+            nTimeout = 0;
+        else if (!setReady.empty())
+            nTimeout = std::min(nTimeout, SOCKET_RETRY_INTERVAL);
+        int nEvents = epoll_wait(hEpoll, events, MAX_SOCKET_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+            nEvents = 0;
+        }
+
+        //
+        // Accept new connections and note which sockets became ready
+        //
+        vEventNodes.clear();
+        for (int i = 0; i < nEvents; i++)
+        {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &hEpollWake) {
+                // The message handler made room in a paused receive buffer
+                uint64_t nCount;
+                if (read(hEpollWake, &nCount, sizeof(nCount)) < 0) {}
+                vEventNodes.insert(vEventNodes.end(), setPaused.begin(), setPaused.end());
+                continue;
+            }
+            bool fListen = false;
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+                if (ptr == &hListenSocket) {
+                    AcceptConnection(hListenSocket);
+                    fListen = true;
+                    break;
+                }
+            }
+            if (fListen)
+                continue;
+            CNode* pnode = (CNode*)ptr;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fRecvReady = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fSendReady = true;
+            vEventNodes.push_back(pnode);
+        }
+        if (!vEventNodes.empty())
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vEventNodes) {
+                if (setReady.insert(pnode).second) {
+                    // Move the reference over from setPaused, or take one
+                    if (!setPaused.erase(pnode))
+                        pnode->AddRef();
+                }
+            }
+        }
+
+        //
+        // Service the ready sockets
+        //
+        fMoreData = false;
+        std::vector<CNode*> vRelease;
+        std::set<CNode*>::iterator it = setReady.begin();
+        while (it != setReady.end())
+        {
+            boost::this_thread::interruption_point();
+
+            CNode* pnode = *it;
+            bool fRetry = false;
+            bool fPause = false;
+
+            // As with select(), queued data is sent before receiving more,
+            // so a peer that does not read is throttled by TCP flow control.
+            // Reading resumes with the writable edge that lets the rest go.
+            bool fSendPending = false;
+            if (pnode->hSocket != INVALID_SOCKET)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend) {
+                    if (pnode->fSendReady && !pnode->vSendMsg.empty())
+                        SocketSendData(pnode);
+                    pnode->fSendReady = false;
+                    fSendPending = !pnode->vSendMsg.empty();
+                } else {
+                    fRetry = true;
+                }
+            }
+
+            if (pnode->hSocket != INVALID_SOCKET && pnode->fRecvReady && !fRetry && !fSendPending)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv) {
+                    for (int nChunks = 0; ; nChunks++) {
+                        if (IsReceiveBufferFull(pnode)) {
+                            fPause = true;
+                            break;
+                        }
+                        if (nChunks == MAX_SOCKET_RECV_CHUNKS) {
+                            fRetry = true;
+                            fMoreData = true;
+                            break;
+                        }
+                        if (SocketRecvData(pnode) <= 0) {
+                            pnode->fRecvReady = false;
+                            break;
+                        }
                     }
+                    pnode->fRecvPaused = fPause;
+                } else {
+                    fRetry = true;
                 }
             }
+
+            if (pnode->hSocket != INVALID_SOCKET && fRetry) {
+                ++it;
+                continue;
+            }
+            if (pnode->hSocket != INVALID_SOCKET && fPause)
+                setPaused.insert(pnode);
+            else
+                vRelease.push_back(pnode);
+            it = setReady.erase(it);
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+        if (!vRelease.empty())
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vRelease)
+                pnode->Release();
         }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1) {
+        SocketEventsLoop();
+        return;
+    }
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -1212,9 +1737,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && !IsReceiveBufferFull(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -1272,39 +1795,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1322,30 +1813,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1849,6 +2317,20 @@ bool OpenNetworkConnection(const CAddress& addrConnect, bool fCountFailure, CSem
 }
 
 
+/** Rotates the node the message handler threads start a pass at */
+static std::atomic<unsigned int> nMessageHandlerOffset(0);
+
+/** Releases a node claimed by a message handler thread, also when handling it throws. */
+class CMessageHandlerClaim
+{
+private:
+    CNode* pnode;
+
+public:
+    explicit CMessageHandlerClaim(CNode* pnodeIn) : pnode(pnodeIn) {}
+    ~CMessageHandlerClaim() { pnode->fInMessageHandler = false; }
+};
+
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
@@ -1867,36 +2349,55 @@ void ThreadMessageHandler()
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Start each pass at a different node, so that the handler threads
+        // spread over the peers instead of all queueing up behind the first.
+        size_t nStart = vNodesCopy.empty() ? 0 : nMessageHandlerOffset++ % vNodesCopy.size();
+        for (size_t i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
-            // Receive messages
+            // Only one thread handles a node at a time, which keeps its
+            // messages in order. A node claimed by another thread is that
+            // thread's work, so it doesn't keep this one awake.
+            bool fExpected = false;
+            if (!pnode->fInMessageHandler.compare_exchange_strong(fExpected, true))
+                continue;
+
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!GetNodeSignals().ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+                CMessageHandlerClaim claim(pnode);
 
-                    if (pnode->nSendSize < SendBufferSize())
+                // Receive messages
+                {
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv)
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        if (!GetNodeSignals().ProcessMessages(pnode))
+                            pnode->CloseSocketDisconnect();
+
+                        // Let the socket handler read from this peer again
+                        if (pnode->fRecvPaused && !IsReceiveBufferFull(pnode))
+                            WakeSocketHandler();
+
+                        if (pnode->nSendSize < SendBufferSize())
                         {
-                            fSleep = false;
+                            if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                            {
+                                fSleep = false;
+                            }
                         }
                     }
                 }
-            }
-            boost::this_thread::interruption_point();
 
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    GetNodeSignals().SendMessages(pnode);
+                // Send messages
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
+                        GetNodeSignals().SendMessages(pnode);
+                }
             }
+
             boost::this_thread::interruption_point();
         }
 
@@ -2103,6 +2604,12 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     fAddressesInitialized = true;
 
+#ifdef USE_EPOLL
+    // Set up the socket backend first: falling back to select() may lower
+    // nMaxConnections, which the outbound limit below depends on.
+    InitSocketEvents();
+#endif
+
     if (semOutbound == NULL) {
         // initialize semaphore
         int nMaxOutbound = std::min((MAX_OUTBOUND_CONNECTIONS + MAX_FEELER_CONNECTIONS), nMaxConnections);
@@ -2136,7 +2643,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlerThreads = std::max(1, std::min((int)GetArg("-msghandthreads", DEFAULT_MESSAGE_HANDLER_THREADS), MAX_MESSAGE_HANDLER_THREADS));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2183,6 +2692,13 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+        if (hEpollWake != -1)
+            close(hEpollWake);
+        hEpoll = hEpollWake = -1;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -2489,6 +3005,10 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fInMessageHandler = false;
+    fRecvPaused = false;
+    fRecvReady = false;
+    fSendReady = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -2632,17 +3152,72 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    std::shared_ptr<CSerializeData> pdata = std::make_shared<CSerializeData>();
+    ssSend.GetAndClear(*pdata);
+    nSendSize += pdata->size();
+    vSendMsg.push_back(pdata);
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushMessagePayload(const char* pszCommand, const CMessagePayloadRef& payload)
+{
+    // The -*messagestest options work on ssSend: with either of them set,
+    // send a copy through EndMessage, so they apply here too without
+    // touching the shared payload.
+    if (mapArgs.count("-dropmessagestest") || mapArgs.count("-fuzzmessagestest")) {
+        BeginMessage(pszCommand);
+        if (!payload->data.empty())
+            ssSend.write(&payload->data[0], payload->data.size());
+        EndMessage(pszCommand);
+        return;
+    }
+
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, payload->data.size());
+    hdr.nChecksum = payload->nChecksum;
+    CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+    ssHeader << hdr;
+    std::shared_ptr<CSerializeData> pheader = std::make_shared<CSerializeData>();
+    ssHeader.GetAndClear(*pheader);
+
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes) peer=%d\n", SanitizeString(pszCommand), payload->data.size(), id);
+
+    //log total amount of bytes per command
+    mapSendBytesPerMsgCmd[std::string(pszCommand)] += payload->data.size() + CMessageHeader::HEADER_SIZE;
+
+    bool fQueueEmpty = vSendMsg.empty();
+    vSendMsg.push_back(pheader);
+    nSendSize += pheader->size();
+    if (!payload->data.empty()) {
+        // Point into the payload, keeping it alive while it is queued
+        vSendMsg.push_back(std::shared_ptr<const CSerializeData>(payload, &payload->data));
+        nSendSize += payload->data.size();
+    }
+
+    // If write queue empty, attempt "optimistic write"
+    if (fQueueEmpty)
+        SocketSendData(this);
+}
+
+CMessagePayload::CMessagePayload(CDataStream& ss)
+{
+    ss.GetAndClear(data);
+    uint256 hash = Hash(data.begin(), data.end());
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+}
+
+CMessagePayload::CMessagePayload(CSerializeData& dataIn)
+{
+    data.swap(dataIn);
+    uint256 hash = Hash(data.begin(), data.end());
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+}
+
 //
 // CBanDB
 //
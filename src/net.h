@@ -9,6 +9,7 @@
 #include "amount.h"
 #include "bloom.h"
 #include "compat.h"
+#include "hash.h"
 #include "limitedmap.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -19,6 +20,7 @@
 
 #include <atomic>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -73,6 +75,10 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** -msghandthreads default, number of threads processing messages from peers */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
+/** Maximum number of -msghandthreads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
@@ -98,6 +104,8 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Wake a message handler thread, e.g. when work for a node was queued from elsewhere */
+void WakeMessageHandler();
 
 struct CombinerAll
 {
@@ -165,6 +173,8 @@ extern CAddrMan addrman;
 
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+/** Connection slots that fit into select(), used if the socket handler cannot use epoll */
+extern int nMaxConnectionsSelect;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -218,6 +228,10 @@ public:
 
 
 class CNetMessage {
+private:
+    mutable CHash256 hasher;        // hash of the data received so far
+    mutable uint256 data_hash;      // set once the message is complete and its hash was asked for
+    mutable bool fHashed;           // whether data_hash is set
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
@@ -232,12 +246,15 @@ public:
 
     CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
+        fHashed = false;
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -251,10 +268,39 @@ public:
         vRecv.SetVersion(nVersionIn);
     }
 
+    /** Double SHA-256 of the message data, hashed as it arrived. Requires complete() */
+    const uint256& GetMessageHash() const;
+
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
 };
 
+/**
+ * A serialized message payload with its checksum. It is never modified once
+ * made, so a payload sent to many peers, like a newly found block, is only
+ * serialized and hashed once, and all their send queues share its buffer.
+ */
+class CMessagePayload
+{
+public:
+    CSerializeData data;
+    unsigned int nChecksum;
+
+    explicit CMessagePayload(CDataStream& ss);
+    //! Takes over the contents of dataIn
+    explicit CMessagePayload(CSerializeData& dataIn);
+};
+typedef std::shared_ptr<const CMessagePayload> CMessagePayloadRef;
+
+/** Serialize obj into a payload that can be queued to any number of peers */
+template<typename T>
+CMessagePayloadRef MakeMessagePayload(int nVersion, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, nVersion);
+    ss << obj;
+    return std::make_shared<const CMessagePayload>(ss);
+}
+
 
 typedef enum BanReason
 {
@@ -329,7 +375,9 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    // Buffers waiting to be sent. A message is either one buffer, or a header
+    // followed by a payload that is shared with other peers.
+    std::deque<std::shared_ptr<const CSerializeData> > vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -337,6 +385,10 @@ public:
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    bool fRecvPaused; // receiving stopped because the receive buffer is full; requires cs_vRecvMsg
+    // Socket readiness reported by epoll and not acted on yet, only used by the socket handler thread
+    bool fRecvReady;
+    bool fSendReady;
 
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -359,6 +411,8 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Set while a message handler thread processes this node, so no other one does at the same time
+    std::atomic<bool> fInMessageHandler;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -396,6 +450,7 @@ public:
     int nStartingHeight;
 
     // flood relay
+    CCriticalSection cs_addrToSend; // guards vAddrToSend and addrKnown, which other peers' handlers relay to
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
@@ -514,11 +569,13 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrToSend);
         addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
     {
+        LOCK(cs_addrToSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -571,6 +628,9 @@ public:
 
     void PushVersion();
 
+    /** Send a message with an already serialized payload, without copying it */
+    void PushMessagePayload(const char* pszCommand, const CMessagePayloadRef& payload);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -0,0 +1,101 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "parallelranges.h"
+
+#include "checkqueue.h"
+#include "util.h"
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+/** One range of a ParallelForRanges call. */
+class CRangeJob
+{
+private:
+    const boost::function<void (size_t, size_t)>* func;
+    size_t nBegin;
+    size_t nEnd;
+
+public:
+    CRangeJob() : func(NULL), nBegin(0), nEnd(0) {}
+    CRangeJob(const boost::function<void (size_t, size_t)>* funcIn, size_t nBeginIn, size_t nEndIn) : func(funcIn), nBegin(nBeginIn), nEnd(nEndIn) {}
+
+    bool operator()()
+    {
+        try {
+            (*func)(nBegin, nEnd);
+        } catch (const std::exception& e) {
+            LogPrintf("ParallelForRanges: range [%u, %u) failed: %s\n", nBegin, nEnd, e.what());
+            return false;
+        } catch (...) {
+            LogPrintf("ParallelForRanges: range [%u, %u) failed: unknown exception\n", nBegin, nEnd);
+            return false;
+        }
+        return true;
+    }
+
+    void swap(CRangeJob& job)
+    {
+        std::swap(func, job.func);
+        std::swap(nBegin, job.nBegin);
+        std::swap(nEnd, job.nEnd);
+    }
+};
+
+CCheckQueue<CRangeJob> rangequeue(1);
+
+//! Number of range worker threads that have started
+std::atomic<int> nRangeWorkers(0);
+
+//! Set while a ParallelForRanges call is the master of rangequeue
+std::atomic<bool> fRangeQueueInUse(false);
+
+} // anon namespace
+
+void ThreadRangeWorker()
+{
+    RenameThread("bitcoin-range");
+    nRangeWorkers++;
+    try {
+        rangequeue.Thread();
+    } catch (...) {
+        // Interrupted at shutdown
+        nRangeWorkers--;
+        throw;
+    }
+}
+
+void ParallelForRanges(size_t nCount, const boost::function<void (size_t, size_t)>& func)
+{
+    // Below this many items per thread, handing out ranges costs more than it saves.
+    static const size_t nMinPerThread = 1024;
+    size_t nThreads = std::min((size_t)nRangeWorkers.load() + 1, nCount / nMinPerThread);
+    bool fExpected = false;
+    if (nThreads <= 1 || !fRangeQueueInUse.compare_exchange_strong(fExpected, true)) {
+        func(0, nCount);
+        return;
+    }
+
+    std::vector<CRangeJob> vJobs;
+    vJobs.reserve(nThreads);
+    size_t nBegin = 0;
+    for (size_t i = 0; i < nThreads; i++) {
+        size_t nEnd = i + 1 == nThreads ? nCount : nBegin + nCount / nThreads;
+        vJobs.push_back(CRangeJob(&func, nBegin, nEnd));
+        nBegin = nEnd;
+    }
+    bool fOk;
+    {
+        CCheckQueueControl<CRangeJob> control(&rangequeue);
+        control.Add(vJobs);
+        fOk = control.Wait();
+    }
+    fRangeQueueInUse = false;
+    if (!fOk)
+        throw std::runtime_error("ParallelForRanges: a range failed");
+}
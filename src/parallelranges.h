@@ -0,0 +1,28 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PARALLELRANGES_H
+#define BITCOIN_PARALLELRANGES_H
+
+#include <stddef.h>
+
+#include <boost/function.hpp>
+
+/** Maximum number of threads (including the calling one) ParallelForRanges spreads work over */
+static const int MAX_RANGE_THREADS = 16;
+
+/** Run instances of this in the background to service ParallelForRanges calls. */
+void ThreadRangeWorker();
+
+/**
+ * Split [0, nCount) into consecutive ranges, one per range worker thread and
+ * one for the calling thread, and call func(nBegin, nEnd) for each of them.
+ * Returns once all calls have finished. Small counts, and calls made while
+ * another thread is using the workers, are handled by a single call on the
+ * calling thread, so callers never wait for each other. An exception thrown
+ * by func on a worker is logged and rethrown as std::runtime_error.
+ */
+void ParallelForRanges(size_t nCount, const boost::function<void (size_t, size_t)>& func);
+
+#endif // BITCOIN_PARALLELRANGES_H
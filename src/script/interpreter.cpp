@@ -1166,6 +1166,33 @@ uint256 GetOutputsHash(const CTransaction& txTo) {
     return ss.GetHash();
 }
 
+/**
+ * Appends serialized data to a byte vector. Used instead of CDataStream,
+ * which would pull support/cleanse into libbitcoinconsensus.
+ */
+class CByteWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+
+public:
+    int nType;
+    int nVersion;
+
+    CByteWriter(std::vector<unsigned char>& vchIn, int nTypeIn, int nVersionIn) : vch(vchIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CByteWriter& write(const char *pch, size_t size) {
+        vch.insert(vch.end(), (const unsigned char*)pch, (const unsigned char*)pch + size);
+        return (*this);
+    }
+
+    template<typename T>
+    CByteWriter& operator<<(const T& obj) {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 } // anon namespace
 
 PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
@@ -1173,6 +1200,50 @@ PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
     hashPrevouts = GetPrevoutHash(txTo);
     hashSequence = GetSequenceHash(txTo);
     hashOutputs = GetOutputsHash(txTo);
+    fLegacyPrecomputed = false;
+}
+
+void PrecomputedTransactionData::PrecomputeLegacy(const CTransaction& txTo)
+{
+    if (fLegacyPrecomputed)
+        return;
+    fLegacyPrecomputed = true;
+
+    // Legacy signatures live in the scriptSig: with fewer than two inputs
+    // that carry one there is nothing to share between signatures.
+    unsigned int nSigInputs = 0;
+    for (unsigned int n = 0; n < txTo.vin.size() && nSigInputs < 2; n++) {
+        if (!txTo.vin[n].scriptSig.empty())
+            nSigInputs++;
+    }
+    if (nSigInputs < 2)
+        return;
+
+    // The serialization CTransactionSignatureSerializer produces for SIGHASH_ALL,
+    // with the scriptCode of the signed input left out.
+    CByteWriter ss(vLegacyInputs, SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    vLegacyInputPos.reserve(txTo.vin.size() + 1);
+    for (unsigned int n = 0; n < txTo.vin.size(); n++) {
+        vLegacyInputPos.push_back(vLegacyInputs.size());
+        ss << txTo.vin[n].prevout << CScriptBase() << txTo.vin[n].nSequence;
+    }
+    vLegacyInputPos.push_back(vLegacyInputs.size());
+
+    CByteWriter ssOutputs(vLegacyOutputs, SER_GETHASH, 0);
+    WriteCompactSize(ssOutputs, txTo.vout.size());
+    for (unsigned int n = 0; n < txTo.vout.size(); n++)
+        ssOutputs << txTo.vout[n];
+    ssOutputs << txTo.nLockTime;
+
+    CHashWriter hasher(SER_GETHASH, 0);
+    hasher.write((const char*)vLegacyInputs.data(), vLegacyInputPos[0]);
+    vLegacyMidstates.reserve(txTo.vin.size());
+    for (unsigned int n = 0; n < txTo.vin.size(); n++) {
+        vLegacyMidstates.push_back(hasher);
+        hasher.write((const char*)vLegacyInputs.data() + vLegacyInputPos[n], vLegacyInputPos[n + 1] - vLegacyInputPos[n]);
+    }
 }
 
 uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CAmount& amount, SigVersion sigversion, const PrecomputedTransactionData* cache)
@@ -1242,6 +1313,21 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    // When all inputs and outputs are signed, only the signed input differs
+    // between the inputs of a transaction: continue from the hasher state
+    // at its start, and append the precomputed remainder.
+    if (cache && !cache->vLegacyMidstates.empty() && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        assert(cache->vLegacyMidstates.size() == txTo.vin.size());
+        CHashWriter ss(cache->vLegacyMidstates[nIn]);
+        txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+        size_t nNext = cache->vLegacyInputPos[nIn + 1];
+        ss.write((const char*)cache->vLegacyInputs.data() + nNext, cache->vLegacyInputs.size() - nNext);
+        ss.write((const char*)cache->vLegacyOutputs.data(), cache->vLegacyOutputs.size());
+        ss << nHashType;
+        return ss.GetHash();
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1356,6 +1442,76 @@ bool TransactionSignatureChecker::CheckSequence(const CScriptNum& nSequence) con
     return true;
 }
 
+/**
+ * Evaluate DUP HASH160 <pubKeyHash> EQUALVERIFY CHECKSIG on the stack
+ * [vchSig, vchPubKey] without going through EvalScript. The outcome and
+ * the error are those of the interpreter, including the final check that
+ * the stack top is true.
+ */
+static bool EvalPayToPubKeyHash(const valtype& vchSig, const valtype& vchPubKey, const unsigned char* pubKeyHash, const CScript& scriptPubKey, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
+{
+    unsigned char hash[20];
+    CHash160().Write(begin_ptr(vchPubKey), vchPubKey.size()).Finalize(hash);
+    if (memcmp(hash, pubKeyHash, sizeof(hash)) != 0)
+        return set_error(serror, SCRIPT_ERR_EQUALVERIFY);
+
+    CScript scriptCode(scriptPubKey);
+    if (sigversion == SIGVERSION_BASE) {
+        scriptCode.FindAndDelete(CScript(vchSig));
+    }
+
+    if (!CheckSignatureEncoding(vchSig, flags, serror) || !CheckPubKeyEncoding(vchPubKey, flags, sigversion, serror)) {
+        //serror is set
+        return false;
+    }
+    if (!checker.CheckSig(vchSig, vchPubKey, scriptCode, sigversion)) {
+        if ((flags & SCRIPT_VERIFY_NULLFAIL) && vchSig.size())
+            return set_error(serror, SCRIPT_ERR_SIG_NULLFAIL);
+        return set_error(serror, SCRIPT_ERR_EVAL_FALSE);
+    }
+    return set_success(serror);
+}
+
+/**
+ * Verify the spend of a pay-to-pubkey-hash output whose scriptSig pushes a
+ * signature and a public key, and which has no witness. These make up most
+ * of the inputs, so they are matched byte by byte and evaluated directly
+ * instead of by the interpreter. Returns false if the scripts don't have
+ * that form; otherwise fResult and serror are set to what VerifyScript
+ * would return for them.
+ */
+static bool VerifyPayToPubKeyHash(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness& witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror, bool& fResult)
+{
+    if (scriptPubKey.size() != 25 ||
+        scriptPubKey[0] != OP_DUP ||
+        scriptPubKey[1] != OP_HASH160 ||
+        scriptPubKey[2] != 20 ||
+        scriptPubKey[23] != OP_EQUALVERIFY ||
+        scriptPubKey[24] != OP_CHECKSIG)
+        return false;
+    if (!witness.IsNull())
+        return false;
+
+    // Anything but exactly two pushes is left to the interpreter, as are
+    // pushes the interpreter would reject.
+    valtype vchPush[2];
+    CScript::const_iterator pc = scriptSig.begin();
+    opcodetype opcode;
+    for (int i = 0; i < 2; i++) {
+        if (!scriptSig.GetOp(pc, opcode, vchPush[i]) || opcode > OP_PUSHDATA4)
+            return false;
+        if (vchPush[i].size() > MAX_SCRIPT_ELEMENT_SIZE)
+            return false;
+        if ((flags & SCRIPT_VERIFY_MINIMALDATA) && !CheckMinimalPush(vchPush[i], opcode))
+            return false;
+    }
+    if (pc != scriptSig.end())
+        return false;
+
+    fResult = EvalPayToPubKeyHash(vchPush[0], vchPush[1], &scriptPubKey[3], scriptPubKey, flags, checker, SIGVERSION_BASE, serror);
+    return true;
+}
+
 static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion, const std::vector<unsigned char>& program, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
 {
     vector<vector<unsigned char> > stack;
@@ -1380,7 +1536,13 @@ static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion,
                 return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_MISMATCH); // 2 items in witness
             }
             scriptPubKey << OP_DUP << OP_HASH160 << program << OP_EQUALVERIFY << OP_CHECKSIG;
-            stack = witness.stack;
+            // Disallow stack item size > MAX_SCRIPT_ELEMENT_SIZE in witness stack
+            for (unsigned int i = 0; i < witness.stack.size(); i++) {
+                if (witness.stack[i].size() > MAX_SCRIPT_ELEMENT_SIZE)
+                    return set_error(serror, SCRIPT_ERR_PUSH_SIZE);
+            }
+            // The program is fixed, so evaluate it directly.
+            return EvalPayToPubKeyHash(witness.stack[0], witness.stack[1], &program[0], scriptPubKey, flags, checker, SIGVERSION_WITNESS_V0, serror);
         } else {
             return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_WRONG_LENGTH);
         }
@@ -1423,6 +1585,10 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         return set_error(serror, SCRIPT_ERR_SIG_PUSHONLY);
     }
 
+    bool fResult;
+    if (VerifyPayToPubKeyHash(scriptSig, scriptPubKey, *witness, flags, checker, serror, fResult))
+        return fResult;
+
     vector<vector<unsigned char> > stack, stackCopy;
     if (!EvalScript(stack, scriptSig, flags, checker, SIGVERSION_BASE, serror))
         // serror is set
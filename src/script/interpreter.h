@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "hash.h"
 #include "script_error.h"
 #include "primitives/transaction.h"
 
@@ -116,7 +117,29 @@ struct PrecomputedTransactionData
 {
     uint256 hashPrevouts, hashSequence, hashOutputs;
 
+    /**
+     * For legacy signatures that commit to all inputs and outputs, which
+     * only differ in the scriptCode of the input being signed. Filled by
+     * PrecomputeLegacy for transactions with at least two inputs that have a
+     * scriptSig: the serialization of the version and all inputs with empty
+     * scripts, the position of each input in it (plus the end), the hasher
+     * state at the start of each input, and the serialization of the outputs
+     * and lock time.
+     */
+    std::vector<unsigned char> vLegacyInputs;
+    std::vector<size_t> vLegacyInputPos;
+    std::vector<CHashWriter> vLegacyMidstates;
+    std::vector<unsigned char> vLegacyOutputs;
+    bool fLegacyPrecomputed;
+
     PrecomputedTransactionData(const CTransaction& tx);
+
+    /**
+     * Fill the legacy fields above, unless done already. Only worth it when
+     * the scripts of tx are going to be run. Not thread safe: call before
+     * handing this to script checks.
+     */
+    void PrecomputeLegacy(const CTransaction& tx);
 };
 
 enum SigVersion
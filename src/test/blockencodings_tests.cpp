@@ -289,6 +289,64 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(LargeMempoolRoundTripTest)
+{
+    // Enough mempool transactions for the short IDs to be matched on several threads
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    CBlock block;
+    block.vtx.push_back(tx);
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    for (int i = 0; i < 10000; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = 0;
+        CTransaction txIn(tx);
+        pool.addUnchecked(txIn.GetHash(), entry.FromTx(txIn));
+        if (i % 50 == 0)
+            block.vtx.push_back(txIn);
+    }
+    tx.vin[0].prevout.hash = GetRandHash();
+    block.vtx.push_back(tx); // Not in the mempool
+
+    bool mutated;
+    block.hashMerkleRoot = BlockMerkleRoot(block, &mutated);
+    assert(!mutated);
+    while (!CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus())) ++block.nNonce;
+
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block, true);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        for (size_t i = 0; i < block.vtx.size() - 1; i++)
+            BOOST_CHECK(partialBlock.IsTxAvailable(i));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(block.vtx.size() - 1));
+
+        CBlock block2;
+        std::vector<CTransaction> vtx_missing;
+        vtx_missing.push_back(block.vtx.back());
+        BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+        BOOST_CHECK_EQUAL(block.hashMerkleRoot.ToString(), BlockMerkleRoot(block2, &mutated).ToString());
+        BOOST_CHECK(!mutated);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest) {
     BlockTransactionsRequest req1;
     req1.blockhash = GetRandHash();
@@ -0,0 +1,161 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "parallelranges.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+namespace {
+
+/** Counts how often it runs, and fails if told to. */
+class CountingCheck
+{
+private:
+    std::atomic<unsigned int>* pnCount;
+    bool fOk;
+
+public:
+    CountingCheck() : pnCount(NULL), fOk(true) {}
+    CountingCheck(std::atomic<unsigned int>* pnCountIn, bool fOkIn) : pnCount(pnCountIn), fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        (*pnCount)++;
+        return fOk;
+    }
+
+    void swap(CountingCheck& check)
+    {
+        std::swap(pnCount, check.pnCount);
+        std::swap(fOk, check.fOk);
+    }
+};
+
+typedef CCheckQueue<CountingCheck> CountingQueue;
+
+/** Add nChecks checks in batches of random size, the one at nFail failing. */
+void AddChecks(CCheckQueueControl<CountingCheck>& control, std::atomic<unsigned int>& nCount, unsigned int nChecks, unsigned int nFail)
+{
+    unsigned int nAdded = 0;
+    while (nAdded < nChecks) {
+        unsigned int nBatch = std::min(nChecks - nAdded, 1 + insecure_rand() % 300);
+        std::vector<CountingCheck> vChecks;
+        for (unsigned int i = 0; i < nBatch; i++)
+            vChecks.push_back(CountingCheck(&nCount, nAdded + i != nFail));
+        control.Add(vChecks);
+        nAdded += nBatch;
+    }
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_checks_run)
+{
+    // Every check runs exactly once, for any amount of work and threads.
+    for (int nThreads = 0; nThreads <= 5; nThreads += 5) {
+        CountingQueue queue(128);
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CountingQueue::Thread, boost::ref(queue)));
+
+        const unsigned int vSizes[] = {0, 1, 2, 127, 128, 129, 1000, 10000, 100000};
+        for (unsigned int n = 0; n < sizeof(vSizes) / sizeof(vSizes[0]); n++) {
+            std::atomic<unsigned int> nCount(0);
+            CCheckQueueControl<CountingCheck> control(&queue);
+            AddChecks(control, nCount, vSizes[n], vSizes[n]);
+            BOOST_CHECK(control.Wait());
+            BOOST_CHECK_EQUAL(nCount.load(), vSizes[n]);
+            CCheckQueueStats stats = control.GetStats();
+            BOOST_CHECK_EQUAL(stats.nChecks, vSizes[n]);
+            BOOST_CHECK(stats.nBatchSize >= 1 && stats.nBatchSize <= 128);
+            if (nThreads == 0)
+                BOOST_CHECK_EQUAL(stats.nSteals, 0U);
+        }
+
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    // A failing check fails the round, and only that round.
+    CountingQueue queue(128);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CountingQueue::Thread, boost::ref(queue)));
+
+    for (int nRound = 0; nRound < 20; nRound++) {
+        std::atomic<unsigned int> nCount(0);
+        unsigned int nChecks = 1 + insecure_rand() % 5000;
+        bool fFail = nRound % 2 == 0;
+        {
+            CCheckQueueControl<CountingCheck> control(&queue);
+            AddChecks(control, nCount, nChecks, fFail ? insecure_rand() % nChecks : nChecks);
+            BOOST_CHECK_EQUAL(control.Wait(), !fFail);
+        }
+        BOOST_CHECK(nCount.load() <= nChecks);
+        if (!fFail)
+            BOOST_CHECK_EQUAL(nCount.load(), nChecks);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+
+namespace {
+
+/** Counts how often each index is visited, and throws at nThrowAt. */
+void VisitRange(std::vector<std::atomic<unsigned int> >& vVisits, size_t nThrowAt, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        if (i == nThrowAt)
+            throw std::runtime_error("VisitRange");
+        vVisits[i]++;
+    }
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(parallel_for_ranges)
+{
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(&ThreadRangeWorker);
+
+    size_t vSizes[] = {0, 1, 1023, 4096, 100000};
+    for (size_t n = 0; n < sizeof(vSizes) / sizeof(vSizes[0]); n++) {
+        // Every index is visited exactly once.
+        std::vector<std::atomic<unsigned int> > vVisits(vSizes[n]);
+        ParallelForRanges(vSizes[n], boost::bind(&VisitRange, boost::ref(vVisits), vSizes[n], _1, _2));
+        for (size_t i = 0; i < vSizes[n]; i++)
+            BOOST_CHECK_EQUAL(vVisits[i].load(), 1U);
+    }
+
+    // An exception on any thread reaches the caller, and the workers survive it.
+    std::vector<std::atomic<unsigned int> > vVisits(100000);
+    BOOST_CHECK_THROW(ParallelForRanges(vVisits.size(), boost::bind(&VisitRange, boost::ref(vVisits), vVisits.size() - 1, _1, _2)), std::runtime_error);
+    BOOST_CHECK_THROW(ParallelForRanges(vVisits.size(), boost::bind(&VisitRange, boost::ref(vVisits), 0, _1, _2)), std::runtime_error);
+    std::vector<std::atomic<unsigned int> > vVisitsAfter(100000);
+    ParallelForRanges(vVisitsAfter.size(), boost::bind(&VisitRange, boost::ref(vVisitsAfter), vVisitsAfter.size(), _1, _2));
+    for (size_t i = 0; i < vVisitsAfter.size(); i++)
+        BOOST_CHECK_EQUAL(vVisitsAfter[i].load(), 1U);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,45 +3,59 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "coinsflush.h"
+#include "coinsprefetch.h"
 #include "random.h"
 #include "script/standard.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 #include "main.h"
+#include "primitives/block.h"
 #include "consensus/validation.h"
+#include "txdb.h"
 
 #include <vector>
 #include <map>
 
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 namespace
 {
+//! equality test
+bool operator==(const Coin &a, const Coin &b) {
+    // Empty Coin objects are always equal.
+    if (a.IsSpent() && b.IsSpent()) return true;
+    return a.fCoinBase == b.fCoinBase &&
+           a.nHeight == b.nHeight &&
+           a.out == b.out;
+}
+
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin);
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -51,8 +65,8 @@ public:
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
                 // Same optimization used in CCoinsViewDB is to only write dirty entries.
-                map_[it->first] = it->second.coins;
-                if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                     // Randomly delete empty entries on write.
                     map_.erase(it->first);
                 }
@@ -75,13 +89,35 @@ public:
         // Manually recompute the dynamic usage of the whole data, and compare it.
         size_t ret = memusage::DynamicUsage(cacheCoins);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coin.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
 
 };
 
+//! Bytes written to the database as they are, to store hand-made legacy records.
+struct RawValue
+{
+    std::vector<unsigned char> vch;
+
+    RawValue(const std::vector<unsigned char>& vchIn) : vch(vchIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const { return vch.size(); }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const { s.write((const char*)&vch[0], vch.size()); }
+};
+
+//! Gives the test access to the raw database to write legacy records.
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    CDBWrapper& GetDB() { return db; }
+};
+
 }
 
 BOOST_FIXTURE_TEST_SUITE(coins_tests, BasicTestingSetup)
@@ -91,7 +127,7 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// It will randomly create/update/delete Coin entries to a tip of caches, with
 // txids picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
@@ -103,13 +139,14 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool removed_all_caches = false;
     bool reached_4_caches = false;
     bool added_an_entry = false;
+    bool added_an_unspendable_entry = false;
     bool removed_an_entry = false;
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -127,36 +164,45 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            Coin& coin = result[COutPoint(txid, 0)];
+            const Coin& entry = (insecure_rand() % 500 == 0) ? AccessByTxid(*stack.back(), txid) : stack.back()->AccessCoin(COutPoint(txid, 0));
+            BOOST_CHECK(coin == entry);
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                bool fWasSpent = coin.IsSpent();
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                if (insecure_rand() % 16 == 0 && fWasSpent) {
+                    // Unspendable outputs are never added to the cache.
+                    newcoin.out.scriptPubKey.assign(1 + insecure_rand() % 64, OP_RETURN);
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    // Random sizes so we can test memory usage accounting.
+                    newcoin.out.scriptPubKey.assign(insecure_rand() % 64, 0);
+                    (fWasSpent ? added_an_entry : updated_an_entry) = true;
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(COutPoint(txid, 0), newcoin, !fWasSpent || insecure_rand() % 2);
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(COutPoint(txid, 0));
             }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -205,6 +251,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
     BOOST_CHECK(added_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
@@ -220,7 +267,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 {
     bool spent_a_duplicate_coinbase = false;
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -273,8 +320,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                 tx.vin[0].prevout.n = 0;
 
                 // Update the expected result of prevouthash to know these coins are spent
-                CCoins& oldcoins = result[prevouthash];
-                oldcoins.Clear();
+                result[tx.vin[0].prevout].Clear();
 
                 // It is of particular importance here that once we spend a coinbase tx hash
                 // it is no longer available to be duplicated (or spent again)
@@ -294,21 +340,18 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             alltxids.insert(tx.GetHash());
 
             // Update the expected result to know about the new output coins
-            CCoins &coins = result[tx.GetHash()];
-            coins.FromTx(tx, height);
+            result[COutPoint(tx.GetHash(), 0)] = Coin(tx.vout[0], height, CTransaction(tx).IsCoinBase());
 
             UpdateCoins(tx, *(stack.back()), height);
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                 } else {
-                    BOOST_CHECK(it->second.IsPruned());
-                 }
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
             }
         }
 
@@ -349,53 +392,36 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 BOOST_AUTO_TEST_CASE(ccoins_serialization)
 {
     // Good example
-    CDataStream ss1(ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e"), SER_DISK, CLIENT_VERSION);
-    CCoins cc1;
+    CDataStream ss1(ParseHex("97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin cc1;
     ss1 >> cc1;
-    BOOST_CHECK_EQUAL(cc1.nVersion, 1);
     BOOST_CHECK_EQUAL(cc1.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc1.nHeight, 203998);
-    BOOST_CHECK_EQUAL(cc1.vout.size(), 2);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(0), false);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(1), true);
-    BOOST_CHECK_EQUAL(cc1.vout[1].nValue, 60000000000ULL);
-    BOOST_CHECK_EQUAL(HexStr(cc1.vout[1].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+    BOOST_CHECK_EQUAL(cc1.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(cc1.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
 
     // Good example
-    CDataStream ss2(ParseHex("0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b"), SER_DISK, CLIENT_VERSION);
-    CCoins cc2;
+    CDataStream ss2(ParseHex("8ddf77bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4"), SER_DISK, CLIENT_VERSION);
+    Coin cc2;
     ss2 >> cc2;
-    BOOST_CHECK_EQUAL(cc2.nVersion, 1);
     BOOST_CHECK_EQUAL(cc2.fCoinBase, true);
     BOOST_CHECK_EQUAL(cc2.nHeight, 120891);
-    BOOST_CHECK_EQUAL(cc2.vout.size(), 17);
-    for (int i = 0; i < 17; i++) {
-        BOOST_CHECK_EQUAL(cc2.IsAvailable(i), i == 4 || i == 16);
-    }
-    BOOST_CHECK_EQUAL(cc2.vout[4].nValue, 234925952);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[4].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee"))))));
-    BOOST_CHECK_EQUAL(cc2.vout[16].nValue, 110397);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[16].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+    BOOST_CHECK_EQUAL(cc2.out.nValue, 110397);
+    BOOST_CHECK_EQUAL(HexStr(cc2.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
 
     // Smallest possible example
-    CDataStream ssx(SER_DISK, CLIENT_VERSION);
-    BOOST_CHECK_EQUAL(HexStr(ssx.begin(), ssx.end()), "");
-
-    CDataStream ss3(ParseHex("0002000600"), SER_DISK, CLIENT_VERSION);
-    CCoins cc3;
+    CDataStream ss3(ParseHex("000006"), SER_DISK, CLIENT_VERSION);
+    Coin cc3;
     ss3 >> cc3;
-    BOOST_CHECK_EQUAL(cc3.nVersion, 0);
     BOOST_CHECK_EQUAL(cc3.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc3.nHeight, 0);
-    BOOST_CHECK_EQUAL(cc3.vout.size(), 1);
-    BOOST_CHECK_EQUAL(cc3.IsAvailable(0), true);
-    BOOST_CHECK_EQUAL(cc3.vout[0].nValue, 0);
-    BOOST_CHECK_EQUAL(cc3.vout[0].scriptPubKey.size(), 0);
+    BOOST_CHECK_EQUAL(cc3.out.nValue, 0);
+    BOOST_CHECK_EQUAL(cc3.out.scriptPubKey.size(), 0);
 
     // scriptPubKey that ends beyond the end of the stream
-    CDataStream ss4(ParseHex("0002000800"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss4(ParseHex("000007"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc4;
+        Coin cc4;
         ss4 >> cc4;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
@@ -406,13 +432,157 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     uint64_t x = 3000000000ULL;
     tmp << VARINT(x);
     BOOST_CHECK_EQUAL(HexStr(tmp.begin(), tmp.end()), "8a95c0bb00");
-    CDataStream ss5(ParseHex("0002008a95c0bb0000"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss5(ParseHex("00008a95c0bb00"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc5;
+        Coin cc5;
         ss5 >> cc5;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    CCoinsViewDBTest view;
+    uint256 txid = GetRandHash();
+
+    // A legacy per-transaction record: version 1, height 203998, output 0
+    // spent and output 1 paying 600 BTC to a P2PKH script.
+    RawValue legacy(ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e"));
+    BOOST_CHECK(view.GetDB().Write(std::make_pair('c', txid), legacy));
+    BOOST_CHECK(!view.HaveCoin(COutPoint(txid, 1)));
+
+    BOOST_CHECK(view.Upgrade());
+    BOOST_CHECK(!view.GetDB().Exists(std::make_pair('c', txid)));
+    BOOST_CHECK(!view.HaveCoin(COutPoint(txid, 0)));
+    Coin coin;
+    BOOST_CHECK(view.GetCoin(COutPoint(txid, 1), coin));
+    BOOST_CHECK_EQUAL(coin.fCoinBase, false);
+    BOOST_CHECK_EQUAL(coin.nHeight, 203998);
+    BOOST_CHECK_EQUAL(coin.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(coin.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+
+    // Running it again on an upgraded database is a no-op.
+    BOOST_CHECK(view.Upgrade());
+    BOOST_CHECK(view.HaveCoin(COutPoint(txid, 1)));
+}
+
+BOOST_AUTO_TEST_CASE(coins_background_flush)
+{
+    CCoinsViewDBTest db;
+    CCoinsViewBackgroundFlush flusher(&db);
+    CCoinsViewCacheTest cache(&flusher);
+
+    COutPoint outpoint1(GetRandHash(), 0);
+    COutPoint outpoint2(GetRandHash(), 1);
+    Coin coin1(CTxOut(10, CScript() << OP_TRUE), 1, false);
+    Coin coin2(CTxOut(20, CScript() << OP_TRUE), 2, true);
+    uint256 hashBlock1 = GetRandHash();
+    uint256 hashBlock2 = GetRandHash();
+
+    // Without a thread, flushes are written out right away.
+    cache.AddCoin(outpoint1, coin1, false);
+    cache.SetBestBlock(hashBlock1);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.HaveCoin(outpoint1));
+    BOOST_CHECK(db.GetBestBlock() == hashBlock1);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+
+    // With one, lookups see the new state whether or not it has been written yet.
+    boost::thread thread(boost::bind(&CCoinsViewBackgroundFlush::ThreadFlush, &flusher));
+    cache.SpendCoin(outpoint1);
+    cache.AddCoin(outpoint2, coin2, false);
+    cache.SetBestBlock(hashBlock2);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!cache.HaveCoin(outpoint1));
+    BOOST_CHECK(cache.AccessCoin(outpoint2) == coin2);
+    BOOST_CHECK(cache.GetBestBlock() == hashBlock2);
+    BOOST_CHECK(flusher.GetBestBlock() == hashBlock2);
+    cache.SelfTest();
+
+    BOOST_CHECK(flusher.Sync());
+    BOOST_CHECK(!db.HaveCoin(outpoint1));
+    Coin coin;
+    BOOST_CHECK(db.GetCoin(outpoint2, coin));
+    BOOST_CHECK(coin == coin2);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+
+    thread.interrupt();
+    thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(coins_prefetch_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    // Confirmed transaction with two outputs, written through to the base view.
+    CMutableTransaction txConfirmed;
+    txConfirmed.vin.resize(1);
+    txConfirmed.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txConfirmed.vout.resize(2);
+    txConfirmed.vout[0].nValue = 10;
+    txConfirmed.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    txConfirmed.vout[1].nValue = 20;
+    txConfirmed.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    {
+        CCoinsViewCacheTest writer(&base);
+        AddCoins(writer, txConfirmed, 1);
+        BOOST_CHECK(writer.Flush());
+    }
+
+    // A block spending the confirmed transaction, a transaction created in the
+    // same block and an unknown transaction.
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(2);
+    txSpend.vin[0].prevout = COutPoint(txConfirmed.GetHash(), 0);
+    txSpend.vin[1].prevout = COutPoint(GetRandHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 5;
+    CMutableTransaction txChild;
+    txChild.vin.resize(2);
+    txChild.vin[0].prevout = COutPoint(txSpend.GetHash(), 0);
+    txChild.vin[1].prevout = COutPoint(txConfirmed.GetHash(), 1);
+    txChild.vout.resize(1);
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vout.resize(1);
+
+    std::shared_ptr<CBlock> pblock(new CBlock());
+    pblock->vtx.push_back(txCoinbase);
+    pblock->vtx.push_back(txSpend);
+    pblock->vtx.push_back(txChild);
+    std::vector<std::shared_ptr<const CBlock> > vBlocks(1, pblock);
+
+    CCoinsPrefetchStats before = GetCoinsPrefetchStats();
+    std::vector<COutPoint> vInputs;
+    GetBlockInputs(vBlocks, vInputs);
+    BOOST_CHECK_EQUAL(vInputs.size(), 3);
+    std::vector<CCoinsPrefetchResult> vResults;
+    BOOST_CHECK_EQUAL(SelectPrefetchReads(cache, vInputs, vResults), 0);
+    ReadPrefetchCoins(base, vResults);
+    AddPrefetchedCoins(cache, vResults);
+    CCoinsPrefetchStats after = GetCoinsPrefetchStats();
+
+    BOOST_CHECK(cache.HaveCoinInCache(COutPoint(txConfirmed.GetHash(), 0)));
+    BOOST_CHECK(cache.HaveCoinInCache(COutPoint(txConfirmed.GetHash(), 1)));
+    BOOST_CHECK(!cache.HaveCoinInCache(COutPoint(txSpend.GetHash(), 0)));
+    BOOST_CHECK(!cache.HaveCoinInCache(txSpend.vin[1].prevout));
+    BOOST_CHECK_EQUAL(cache.AccessCoin(COutPoint(txConfirmed.GetHash(), 1)).out.nValue, 20);
+    BOOST_CHECK_EQUAL(after.nBlocks - before.nBlocks, 1);
+    BOOST_CHECK_EQUAL(after.nHits - before.nHits, 0);
+    BOOST_CHECK_EQUAL(after.nMisses - before.nMisses, 3);
+    BOOST_CHECK_EQUAL(after.nNotFound - before.nNotFound, 1);
+    cache.SelfTest();
+
+    // A second pass finds everything cached and only reads the unknown input.
+    vResults.clear();
+    BOOST_CHECK_EQUAL(SelectPrefetchReads(cache, vInputs, vResults), 2);
+    BOOST_CHECK_EQUAL(vResults.size(), 1);
+    BOOST_CHECK(vResults[0].outpoint == txSpend.vin[1].prevout);
+    BOOST_CHECK_EQUAL(GetCoinsPrefetchStats().nHits - after.nHits, 2);
+    cache.SelfTest();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
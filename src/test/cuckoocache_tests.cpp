@@ -0,0 +1,123 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "random.h"
+#include "uint256.h"
+#include "test/test_bitcoin.h"
+
+#include <cstring>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+namespace {
+
+/** Uses the words of a (random) uint256 as its eight hashes, like the signature cache. */
+class TestHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        uint32_t u;
+        std::memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+typedef CuckooCache::cache<uint256, TestHasher> TestCache;
+
+std::vector<uint256> RandomHashes(size_t n)
+{
+    std::vector<uint256> v(n);
+    for (size_t i = 0; i < n; i++)
+        v[i] = GetRandHash();
+    return v;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_empty)
+{
+    // A cache set up for no entries must still answer lookups.
+    TestCache cache;
+    cache.setup_bytes(0);
+    BOOST_CHECK(!cache.contains(GetRandHash(), false));
+    uint256 hash = GetRandHash();
+    cache.insert(hash);
+    BOOST_CHECK(cache.contains(hash, false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate)
+{
+    // Filling the cache to half its capacity must keep (nearly) everything.
+    TestCache cache;
+    uint32_t nSize = cache.setup(1 << 14);
+    BOOST_CHECK_EQUAL(nSize, 1U << 14);
+    std::vector<uint256> vHash = RandomHashes(nSize / 2);
+    for (size_t i = 0; i < vHash.size(); i++)
+        cache.insert(vHash[i]);
+    size_t nHits = 0;
+    for (size_t i = 0; i < vHash.size(); i++)
+        nHits += cache.contains(vHash[i], false);
+    BOOST_CHECK(nHits >= vHash.size() * 99 / 100);
+
+    // Unknown entries are never found.
+    std::vector<uint256> vOther = RandomHashes(1000);
+    for (size_t i = 0; i < vOther.size(); i++)
+        BOOST_CHECK(!cache.contains(vOther[i], false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase)
+{
+    // Erased entries stay readable until their slots are needed, and are
+    // replaced before entries that were not erased.
+    TestCache cache;
+    uint32_t nSize = cache.setup(1 << 12);
+    std::vector<uint256> vErased = RandomHashes(nSize / 2);
+    std::vector<uint256> vKept = RandomHashes(nSize / 4);
+    for (size_t i = 0; i < vErased.size(); i++)
+        cache.insert(vErased[i]);
+    for (size_t i = 0; i < vKept.size(); i++)
+        cache.insert(vKept[i]);
+    for (size_t i = 0; i < vErased.size(); i++)
+        cache.contains(vErased[i], true);
+    size_t nErasedHits = 0;
+    for (size_t i = 0; i < vErased.size(); i++)
+        nErasedHits += cache.contains(vErased[i], false);
+    BOOST_CHECK(nErasedHits >= vErased.size() * 99 / 100);
+
+    std::vector<uint256> vNew = RandomHashes(nSize / 2);
+    for (size_t i = 0; i < vNew.size(); i++)
+        cache.insert(vNew[i]);
+    size_t nKeptHits = 0;
+    for (size_t i = 0; i < vKept.size(); i++)
+        nKeptHits += cache.contains(vKept[i], false);
+    BOOST_CHECK(nKeptHits >= vKept.size() * 95 / 100);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_generations)
+{
+    // Without any erases, old generations are evicted in favour of new ones.
+    TestCache cache;
+    uint32_t nSize = cache.setup(1 << 12);
+    std::vector<std::vector<uint256> > vGenerations;
+    for (int n = 0; n < 10; n++) {
+        vGenerations.push_back(RandomHashes(nSize / 4));
+        for (size_t i = 0; i < vGenerations.back().size(); i++)
+            cache.insert(vGenerations.back()[i]);
+    }
+    size_t nNewest = 0, nOldest = 0;
+    for (size_t i = 0; i < vGenerations.back().size(); i++)
+        nNewest += cache.contains(vGenerations.back()[i], false);
+    for (size_t i = 0; i < vGenerations.front().size(); i++)
+        nOldest += cache.contains(vGenerations.front()[i], false);
+    BOOST_CHECK(nNewest >= vGenerations.back().size() * 95 / 100);
+    BOOST_CHECK(nOldest < nNewest);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
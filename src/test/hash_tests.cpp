@@ -126,6 +126,13 @@ BOOST_AUTO_TEST_CASE(siphash)
     CHashWriter ss(SER_DISK, CLIENT_VERSION);
     ss << CTransaction();
     BOOST_CHECK_EQUAL(SipHashUint256(1, 2, ss.GetHash()), 0x79751e980c2a0a35ULL);
+
+    // Check that the outpoint variant matches hashing the extra 4 bytes after the uint256
+    uint256 val = uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    CSipHasher hasher4(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    static const unsigned char t5[4] = {0x23,0x22,0x21,0x20};
+    hasher4.Write(val.GetUint64(0)).Write(val.GetUint64(1)).Write(val.GetUint64(2)).Write(val.GetUint64(3)).Write(t5, 4);
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val, 0x20212223), hasher4.Finalize());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,9 +4,12 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "txdb.h"
 
 #include "test/test_bitcoin.h"
 
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -72,4 +75,72 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+/** Reload the block index and check that it matches the one before, and where it was loaded from. */
+static void CheckReloadBlockIndex(bool fExpectSnapshot)
+{
+    LOCK(cs_main);
+    std::map<uint256, std::string> mapBefore;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        mapBefore[item.first] = strprintf("%s %s %d %d %u", item.second->ToString(), item.second->nChainWork.GetHex(), item.second->nChainTx, item.second->nStatus, item.second->nUndoPos);
+    uint256 hashTip = chainActive.Tip()->GetBlockHash();
+
+    UnloadBlockIndex();
+    BOOST_CHECK(LoadBlockIndex());
+    BOOST_CHECK_EQUAL(IsBlockIndexFromSnapshot(), fExpectSnapshot);
+    BOOST_CHECK(chainActive.Tip() != NULL && chainActive.Tip()->GetBlockHash() == hashTip);
+    BOOST_CHECK(pindexBestHeader == chainActive.Tip());
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), mapBefore.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        BOOST_CHECK_EQUAL(mapBefore[item.first], strprintf("%s %s %d %d %u", item.second->ToString(), item.second->nChainWork.GetHex(), item.second->nChainTx, item.second->nStatus, item.second->nUndoPos));
+}
+
+BOOST_AUTO_TEST_CASE(block_index_snapshot)
+{
+    boost::filesystem::path path = GetDataDir() / "blocks" / "index.snapshot";
+    FlushStateToDisk();
+
+    // A snapshot is loaded once and then removed.
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(WriteBlockIndexSnapshot());
+    }
+    BOOST_CHECK(boost::filesystem::exists(path));
+    CheckReloadBlockIndex(true);
+    BOOST_CHECK(!boost::filesystem::exists(path));
+
+    // Without a snapshot the index is loaded from the database.
+    CheckReloadBlockIndex(false);
+
+    // A snapshot is ignored once the block tree database has changed.
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(WriteBlockIndexSnapshot());
+        std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
+        std::vector<const CBlockIndex*> vBlocks(1, chainActive.Tip());
+        int nLastBlockFile = 0;
+        BOOST_CHECK(pblocktree->ReadLastBlockFile(nLastBlockFile));
+        BOOST_CHECK(pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks));
+    }
+    CheckReloadBlockIndex(false);
+    BOOST_CHECK(!boost::filesystem::exists(path));
+
+    // A corrupted snapshot is ignored.
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(WriteBlockIndexSnapshot());
+    }
+    {
+        FILE* file = fopen(path.string().c_str(), "r+b");
+        BOOST_REQUIRE(file != NULL);
+        fseek(file, 100, SEEK_SET);
+        int c = fgetc(file);
+        fseek(file, 100, SEEK_SET);
+        fputc(c ^ 0x55, file);
+        fclose(file);
+    }
+    CheckReloadBlockIndex(false);
+    BOOST_CHECK(!boost::filesystem::exists(path));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
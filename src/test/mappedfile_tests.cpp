@@ -0,0 +1,91 @@
+// Copyright (c) 2026 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "mappedfile.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+static void AppendToFile(const boost::filesystem::path& path, const std::vector<unsigned char>& data)
+{
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file != NULL);
+    BOOST_REQUIRE_EQUAL(fwrite(data.data(), 1, data.size(), file), data.size());
+    fclose(file);
+}
+
+BOOST_FIXTURE_TEST_SUITE(mappedfile_tests, BasicTestingSetup)
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(mappedfile_cache)
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::path path2 = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CMappedFileCache cache(1);
+
+    // Missing and empty files can't be mapped
+    BOOST_CHECK(!cache.Get(path, 0));
+    AppendToFile(path, std::vector<unsigned char>());
+    BOOST_CHECK(!cache.Get(path, 0));
+
+    std::vector<unsigned char> data(100);
+    for (unsigned int i = 0; i < data.size(); i++)
+        data[i] = i;
+    AppendToFile(path, data);
+    std::shared_ptr<const CMappedFile> pfile = cache.Get(path, data.size());
+    BOOST_REQUIRE(pfile);
+    BOOST_CHECK_EQUAL(pfile->size(), data.size());
+    BOOST_CHECK(memcmp(pfile->data(), data.data(), data.size()) == 0);
+    BOOST_CHECK(cache.Get(path, 10) == pfile);
+
+    // Asking for more than the file holds fails until the file grows
+    BOOST_CHECK(!cache.Get(path, 150));
+    AppendToFile(path, std::vector<unsigned char>(50, 0xff));
+    std::shared_ptr<const CMappedFile> pgrown = cache.Get(path, 150);
+    BOOST_REQUIRE(pgrown);
+    BOOST_CHECK(pgrown != pfile);
+    BOOST_CHECK_EQUAL(pgrown->size(), 150U);
+    BOOST_CHECK_EQUAL(pgrown->data()[149], 0xff);
+    // The old mapping stays usable while it is held
+    BOOST_CHECK(memcmp(pfile->data(), data.data(), data.size()) == 0);
+
+    // Mapping another file unmaps the least recently used one
+    AppendToFile(path2, data);
+    BOOST_CHECK(cache.Get(path2, 0));
+    BOOST_CHECK(cache.Get(path, 0) != pgrown);
+
+    std::shared_ptr<const CMappedFile> pcached = cache.Get(path, 0);
+    cache.Erase(path);
+    BOOST_CHECK(cache.Get(path, 0) != pcached);
+
+    boost::filesystem::remove(path);
+    boost::filesystem::remove(path2);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(memory_reader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    std::vector<unsigned char> vch(3, 7);
+    ss << (uint32_t)0x01020304 << vch;
+    std::vector<char> data(ss.begin(), ss.end());
+
+    CMemoryReader reader(SER_DISK, CLIENT_VERSION, data.data(), data.data() + data.size());
+    uint32_t n;
+    std::vector<unsigned char> vchRead;
+    reader >> n >> vchRead;
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+    BOOST_CHECK(vchRead == vch);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -133,4 +133,21 @@ BOOST_AUTO_TEST_CASE(merkle_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(merkle_root_levels)
+{
+    // The batched level-by-level root must agree with the constant-space
+    // computation used for branches, for every parity of every level.
+    for (int ntx = 1; ntx <= 70; ntx++) {
+        std::vector<uint256> leaves(ntx);
+        for (int j = 0; j < ntx; j++) {
+            leaves[j] = GetRandHash();
+        }
+        bool mutated = true;
+        uint256 root = ComputeMerkleRoot(leaves, &mutated);
+        BOOST_CHECK(!mutated);
+        int pos = insecure_rand() % ntx;
+        BOOST_CHECK(ComputeMerkleRootFromBranch(leaves[pos], ComputeMerkleBranch(leaves, pos), pos) == root);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -164,4 +164,47 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(cnode_receive_chunked)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CNode node(INVALID_SOCKET, CAddress(CService(ipv4Addr, 7777), NODE_NETWORK), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // Large messages are received into pooled buffers, small ones are not
+    unsigned int sizes[] = {0, 1000, 300 * 1000, 1100 * 1000, 1100 * 1000};
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        std::vector<char> payload(sizes[i]);
+        for (unsigned int j = 0; j < payload.size(); j++)
+            payload[j] = insecure_rand();
+        uint256 hash = Hash(payload.begin(), payload.end());
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr(Params().MessageStart(), "block", payload.size());
+        hdr.nChecksum = ReadLE32(hash.begin());
+        ss << hdr;
+        ss.insert(ss.end(), payload.begin(), payload.end());
+
+        // Feed the message in uneven pieces, the way it comes off a socket
+        unsigned int nPos = 0;
+        while (nPos < ss.size()) {
+            unsigned int nBytes = std::min((unsigned int)ss.size() - nPos, 1 + insecure_rand() % 70000);
+            BOOST_CHECK(node.ReceiveMsgBytes(&ss[nPos], nBytes));
+            nPos += nBytes;
+        }
+
+        BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 1U);
+        const CNetMessage& msg = node.vRecvMsg.front();
+        BOOST_CHECK(msg.complete());
+        BOOST_CHECK(msg.GetMessageHash() == hash);
+        BOOST_CHECK_EQUAL(msg.vRecv.size(), payload.size());
+        BOOST_CHECK(std::equal(payload.begin(), payload.end(), msg.vRecv.begin()));
+        // Pooled buffers are a power of two of at least 64 KiB in size
+        size_t nCapacity = msg.vRecv.capacity();
+        bool fPooled = nCapacity >= (1 << 16) && (nCapacity & (nCapacity - 1)) == 0;
+        BOOST_CHECK_EQUAL(fPooled, payload.size() >= (1 << 16));
+        node.vRecvMsg.clear();
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1443,4 +1443,123 @@ BOOST_AUTO_TEST_CASE(script_FindAndDelete)
     BOOST_CHECK(s == expect);
 }
 
+/** Evaluate a spend the way VerifyScript does for scripts without P2SH, step by step through EvalScript. */
+static bool EvalSpend(const CScript& scriptSig, const CScript& scriptPubKey, std::vector<std::vector<unsigned char> > stack, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* err)
+{
+    if (!EvalScript(stack, scriptSig, flags, checker, sigversion, err))
+        return false;
+    if (!EvalScript(stack, scriptPubKey, flags, checker, sigversion, err))
+        return false;
+    // The scripts tested end in CHECKSIG, which leaves an empty element for false
+    if (stack.empty() || stack.back().empty() || (sigversion == SIGVERSION_WITNESS_V0 && stack.size() != 1)) {
+        *err = SCRIPT_ERR_EVAL_FALSE;
+        return false;
+    }
+    *err = SCRIPT_ERR_OK;
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(script_p2pkh_fast_path)
+{
+    // Spends of P2PKH and P2WPKH outputs don't go through the interpreter;
+    // their results must be the same as if they did.
+    CKey key, key2;
+    key.MakeNewKey(true);
+    key2.MakeNewKey(false);
+    std::vector<unsigned char> vchPubKey = ToByteVector(key.GetPubKey());
+    std::vector<unsigned char> vchPubKey2 = ToByteVector(key2.GetPubKey());
+    CKeyID keyID = key.GetPubKey().GetID();
+
+    CScript scriptPubKey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(keyID) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript witnessPubKey = CScript() << OP_0 << ToByteVector(keyID);
+    const CAmount amount = 12345;
+
+    for (int witness = 0; witness < 2; witness++) {
+        SigVersion sigversion = witness ? SIGVERSION_WITNESS_V0 : SIGVERSION_BASE;
+        CMutableTransaction txCredit = BuildCreditingTransaction(witness ? witnessPubKey : scriptPubKey, amount);
+        CMutableTransaction txSpend = BuildSpendingTransaction(CScript(), CScriptWitness(), txCredit);
+        uint256 hash = SignatureHash(scriptPubKey, txSpend, 0, SIGHASH_ALL, amount, sigversion);
+        uint256 hashOther = SignatureHash(scriptPubKey, txSpend, 0, SIGHASH_NONE, amount, sigversion);
+
+        std::vector<unsigned char> vchSig, vchSigHighS, vchSigOther, vchSigWrongKey, vchSigBad;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        vchSig.push_back(SIGHASH_ALL);
+        vchSigHighS = vchSig;
+        NegateSignatureS(vchSigHighS);
+        BOOST_CHECK(key.Sign(hashOther, vchSigOther));
+        vchSigOther.push_back(SIGHASH_ALL);
+        BOOST_CHECK(key2.Sign(hash, vchSigWrongKey));
+        vchSigWrongKey.push_back(SIGHASH_ALL);
+        vchSigBad = vchSig;
+        vchSigBad[10] ^= 1;
+
+        std::vector<std::vector<std::vector<unsigned char> > > vStacks;
+        vStacks.push_back({vchSig, vchPubKey});
+        vStacks.push_back({vchSigHighS, vchPubKey});
+        vStacks.push_back({vchSigOther, vchPubKey});
+        vStacks.push_back({vchSigWrongKey, vchPubKey2});
+        vStacks.push_back({vchSigBad, vchPubKey});
+        vStacks.push_back({vchSig, vchPubKey2});
+        vStacks.push_back({std::vector<unsigned char>(), vchPubKey});
+        vStacks.push_back({vchSig, std::vector<unsigned char>()});
+        vStacks.push_back({vchSig, std::vector<unsigned char>(521, 2)});
+        vStacks.push_back({vchSig});
+        vStacks.push_back({vchSig, vchSig, vchPubKey});
+
+        std::vector<unsigned int> vFlags;
+        vFlags.push_back(SCRIPT_VERIFY_NONE);
+        vFlags.push_back(SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC);
+        vFlags.push_back(SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_LOW_S | SCRIPT_VERIFY_NULLFAIL | SCRIPT_VERIFY_MINIMALDATA | SCRIPT_VERIFY_SIGPUSHONLY);
+
+        BOOST_FOREACH(const std::vector<std::vector<unsigned char> >& stack, vStacks) {
+            CScript scriptSig;
+            CScriptWitness scriptWitness;
+            if (witness) {
+                scriptWitness.stack = stack;
+            } else {
+                BOOST_FOREACH(const std::vector<unsigned char>& vch, stack)
+                    scriptSig << vch;
+            }
+            BOOST_FOREACH(unsigned int flags, vFlags) {
+                if (witness && !(flags & SCRIPT_VERIFY_WITNESS))
+                    continue;
+                MutableTransactionSignatureChecker checker(&txSpend, 0, amount);
+                ScriptError err, errExpected;
+                bool fExpected;
+                if (witness && stack.size() != 2) {
+                    fExpected = false;
+                    errExpected = SCRIPT_ERR_WITNESS_PROGRAM_MISMATCH;
+                } else if (std::any_of(stack.begin(), stack.end(), [](const std::vector<unsigned char>& vch) { return vch.size() > MAX_SCRIPT_ELEMENT_SIZE; })) {
+                    fExpected = false;
+                    errExpected = SCRIPT_ERR_PUSH_SIZE;
+                } else {
+                    fExpected = EvalSpend(scriptSig, scriptPubKey, witness ? stack : std::vector<std::vector<unsigned char> >(), flags, checker, sigversion, &errExpected);
+                }
+                bool fResult = VerifyScript(scriptSig, witness ? witnessPubKey : scriptPubKey, &scriptWitness, flags, checker, &err);
+                BOOST_CHECK_EQUAL(fResult, fExpected);
+                BOOST_CHECK_MESSAGE(err == errExpected, std::string(FormatScriptError(err)) + " where " + std::string(FormatScriptError(errExpected)) + " expected");
+            }
+        }
+        if (witness)
+            break;
+
+        // A valid spend with a witness attached fails, as in the interpreter.
+        CScriptWitness scriptWitness;
+        scriptWitness.stack.push_back(vchSig);
+        ScriptError err;
+        unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_WITNESS;
+        BOOST_CHECK(!VerifyScript(CScript() << vchSig << vchPubKey, scriptPubKey, &scriptWitness, flags, MutableTransactionSignatureChecker(&txSpend, 0, amount), &err));
+        BOOST_CHECK_EQUAL(err, SCRIPT_ERR_WITNESS_UNEXPECTED);
+
+        // Non-minimal pushes are left to the interpreter.
+        CScript scriptSig = CScript() << vchSig;
+        scriptSig.push_back(OP_PUSHDATA1);
+        scriptSig.push_back(vchPubKey.size());
+        scriptSig.insert(scriptSig.end(), vchPubKey.begin(), vchPubKey.end());
+        BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, NULL, SCRIPT_VERIFY_NONE, MutableTransactionSignatureChecker(&txSpend, 0, amount), &err));
+        BOOST_CHECK(!VerifyScript(scriptSig, scriptPubKey, NULL, SCRIPT_VERIFY_MINIMALDATA, MutableTransactionSignatureChecker(&txSpend, 0, amount), &err));
+        BOOST_CHECK_EQUAL(err, SCRIPT_ERR_MINIMALDATA);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -166,6 +166,54 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+BOOST_AUTO_TEST_CASE(sighash_precomputed)
+{
+    // The shared legacy serialization in PrecomputedTransactionData must give
+    // the same hash for every input and hash type, also with many inputs.
+    for (int i = 0; i < 2000; i++) {
+        int nHashType = insecure_rand();
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        if (i % 100 == 0) {
+            for (int n = 0; n < 200; n++) {
+                txTo.vin.push_back(txTo.vin[insecure_rand() % txTo.vin.size()]);
+                txTo.vin.back().prevout.hash = GetRandHash();
+            }
+        }
+        CTransaction tx(txTo);
+        PrecomputedTransactionData txdata(tx);
+        txdata.PrecomputeLegacy(tx);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++) {
+            BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType, 0, SIGVERSION_BASE, &txdata) == SignatureHashOld(scriptCode, tx, nIn, nHashType));
+        }
+    }
+
+    // Without legacy signatures in the inputs the shared data is not built.
+    CMutableTransaction txTo;
+    RandomTransaction(txTo, false);
+    txTo.vin.resize(3);
+    for (unsigned int n = 0; n < txTo.vin.size(); n++)
+        txTo.vin[n].scriptSig = CScript();
+    CTransaction tx(txTo);
+    PrecomputedTransactionData txdata(tx);
+    txdata.PrecomputeLegacy(tx);
+    BOOST_CHECK(txdata.vLegacyMidstates.empty());
+    BOOST_CHECK(txdata.vLegacyInputs.empty());
+
+    // Nor is it built before PrecomputeLegacy is called.
+    RandomTransaction(txTo, false);
+    txTo.vin.resize(3);
+    for (unsigned int n = 0; n < txTo.vin.size(); n++)
+        txTo.vin[n].scriptSig = CScript() << OP_1;
+    CTransaction txSigned(txTo);
+    PrecomputedTransactionData txdataSigned(txSigned);
+    BOOST_CHECK(txdataSigned.vLegacyMidstates.empty());
+    txdataSigned.PrecomputeLegacy(txSigned);
+    BOOST_CHECK_EQUAL(txdataSigned.vLegacyMidstates.size(), 3);
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
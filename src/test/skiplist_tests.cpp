@@ -7,6 +7,7 @@
 #include "util.h"
 #include "test/test_bitcoin.h"
 
+#include <set>
 #include <vector>
 
 #include <boost/test/unit_test.hpp>
@@ -100,4 +101,38 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blockindex_arena_test)
+{
+    CBlockIndexArena arena;
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+
+    // Allocate across several chunks; every entry must be distinct and start out null.
+    std::vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < 10000; i++) {
+        CBlockIndex* pindex = arena.Allocate();
+        BOOST_CHECK(pindex->pprev == NULL && pindex->nHeight == 0 && pindex->nSequenceId == 0 && !pindex->fChecked);
+        pindex->nHeight = i;
+        vIndex.push_back(pindex);
+    }
+    BOOST_CHECK_EQUAL(arena.size(), 10000U);
+    BOOST_CHECK_EQUAL(std::set<CBlockIndex*>(vIndex.begin(), vIndex.end()).size(), 10000U);
+
+    // Entries keep their contents while more are allocated.
+    for (int i = 0; i < 10000; i++)
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, i);
+
+    // The bitfields hold their full range independently.
+    CBlockIndex* pindex = arena.Allocate();
+    pindex->nSequenceId = 0x7fffffff;
+    pindex->fChecked = true;
+    BOOST_CHECK_EQUAL(pindex->nSequenceId, 0x7fffffffU);
+    pindex->nSequenceId = 0;
+    BOOST_CHECK(pindex->fChecked);
+
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+    BOOST_CHECK(arena.Allocate() != NULL);
+    BOOST_CHECK_EQUAL(arena.size(), 1U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
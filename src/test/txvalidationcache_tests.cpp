@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "coins.h"
 #include "consensus/validation.h"
 #include "key.h"
 #include "main.h"
@@ -83,4 +84,57 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(checkinputs_script_execution_cache, TestingSetup)
+{
+    // A transaction whose scripts passed with a set of flags is not
+    // interpreted again for those flags, and only for those flags.
+    CKey key, otherKey;
+    key.MakeNewKey(true);
+    otherKey.MakeNewKey(true);
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CScript otherScriptPubKey = CScript() << ToByteVector(otherKey.GetPubKey()) << OP_CHECKSIG;
+
+    COutPoint prevout(GetRandHash(), 0);
+    CCoinsViewCache view(pcoinsTip);
+    view.AddCoin(prevout, Coin(CTxOut(COIN, scriptPubKey), 0, false), false);
+    // The same coin, but locked to a key that didn't sign.
+    CCoinsViewCache otherView(pcoinsTip);
+    otherView.AddCoin(prevout, Coin(CTxOut(COIN, otherScriptPubKey), 0, false), false);
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = prevout;
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = COIN - 1000;
+    mtx.vout[0].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, mtx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    mtx.vin[0].scriptSig << vchSig;
+    CTransaction tx(mtx);
+
+    LOCK(cs_main);
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
+    CValidationState state;
+    PrecomputedTransactionData txdata(tx);
+    BOOST_CHECK(!CheckInputs(tx, state, otherView, true, flags, false, false, txdata));
+
+    // Not remembered without cacheFullScriptStore.
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true, false, txdata));
+    BOOST_CHECK(!CheckInputs(tx, state, otherView, true, flags, false, false, txdata));
+
+    // Remembered, so the scripts are skipped; other flags still run them.
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true, true, txdata));
+    BOOST_CHECK(CheckInputs(tx, state, otherView, true, flags, false, false, txdata));
+    BOOST_CHECK(!CheckInputs(tx, state, otherView, true, flags | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY, false, false, txdata));
+
+    // Deferred checks are not assumed to pass.
+    std::vector<CScriptCheck> vChecks;
+    unsigned int otherFlags = SCRIPT_VERIFY_P2SH;
+    BOOST_CHECK(CheckInputs(tx, state, view, true, otherFlags, true, true, txdata, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+    BOOST_CHECK(!CheckInputs(tx, state, otherView, true, otherFlags, false, false, txdata));
+}
+
 BOOST_AUTO_TEST_SUITE_END()